@@ -0,0 +1,105 @@
+#include "cancellation.h"
+
+#include <algorithm>
+
+namespace sylar {
+
+// 現在のファイバーのトークン
+static FiberLocal<std::shared_ptr<CancellationToken>> s_token;
+
+std::shared_ptr<CancellationToken> CancellationToken::child()
+{
+	std::shared_ptr<CancellationToken> token = std::make_shared<CancellationToken>();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if(!isCancelled())
+		{
+			// 終了したリクエストの子トークンが溜まらないように、破棄済みのものを取り除く
+			if(m_children.size() >= std::max<size_t>(m_childrenPruned * 2, 16))
+			{
+				m_children.erase(std::remove_if(m_children.begin(), m_children.end(),
+					[](const std::weak_ptr<CancellationToken>& c){return c.expired();}), m_children.end());
+				m_childrenPruned = m_children.size();
+			}
+			m_children.push_back(token);
+			return token;
+		}
+	}
+	// 親がキャンセル済み -> 子も最初からキャンセル済み
+	token->cancel();
+	return token;
+}
+
+void CancellationToken::cancel()
+{
+	std::function<void()> waiter;
+	std::vector<std::weak_ptr<CancellationToken>> children;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if(m_cancelled.exchange(true, std::memory_order_acq_rel))
+		{
+			return;
+		}
+		waiter.swap(m_waiter);
+		children.swap(m_children);
+	}
+
+	// ロックの外で中断する -> 待機中のファイバーが再スケジュールされる
+	if(waiter)
+	{
+		waiter();
+	}
+	for(auto& i : children)
+	{
+		std::shared_ptr<CancellationToken> c = i.lock();
+		if(c)
+		{
+			c->cancel();
+		}
+	}
+}
+
+bool CancellationToken::setWaiter(std::function<void()> abort)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if(isCancelled())
+	{
+		return false;
+	}
+	m_waiter = std::move(abort);
+	return true;
+}
+
+void CancellationToken::clearWaiter()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_waiter = nullptr;
+}
+
+std::shared_ptr<CancellationToken> CancellationToken::GetThis()
+{
+	std::shared_ptr<CancellationToken>* token = s_token.peek();
+	return token ? *token : nullptr;
+}
+
+void CancellationToken::SetThis(std::shared_ptr<CancellationToken> token)
+{
+	s_token.set(std::move(token));
+}
+
+std::shared_ptr<CancellationToken> CancellationToken::Inherit()
+{
+	std::shared_ptr<CancellationToken>* curr = s_token.peek();
+	if(!curr || !*curr)
+	{
+		return nullptr;
+	}
+	return (*curr)->child();
+}
+
+void CancellationToken::SetFor(Fiber* fiber, std::shared_ptr<CancellationToken> token)
+{
+	s_token.setFor(fiber, std::move(token));
+}
+
+}
@@ -0,0 +1,55 @@
+#ifndef _CANCELLATION_H_
+#define _CANCELLATION_H_
+
+#include "fiber.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace sylar {
+
+// キャンセルトークン -> ファイバーごとに設定され、フックされた待機（I/O・connect・sleep）を ECANCELED で中断する
+// 設定されたファイバーから scheduleLock() したコールバックには子トークンが引き継がれ、親のキャンセルが伝播する
+class CancellationToken : public std::enable_shared_from_this<CancellationToken>
+{
+public:
+	// 親のキャンセルが伝播する子トークンを作成
+	std::shared_ptr<CancellationToken> child();
+
+	// キャンセルする -> 待機中なら中断し、子トークンもキャンセルする
+	void cancel();
+	bool isCancelled() const {return m_cancelled.load(std::memory_order_acquire);}
+
+	// 現在の待機を中断する処理を登録 -> すでにキャンセル済みなら登録せずに false
+	bool setWaiter(std::function<void()> abort);
+	// 待機が終わった -> 登録を解除
+	void clearWaiter();
+
+public:
+	// 現在のファイバーのトークン -> 未設定なら nullptr
+	static std::shared_ptr<CancellationToken> GetThis();
+	// 現在のファイバーにトークンを設定 -> ファイバーの終了時に解除される
+	static void SetThis(std::shared_ptr<CancellationToken> token);
+
+	// 現在のファイバーにトークンがある -> タスクに引き継ぐ子トークン / なければ nullptr
+	static std::shared_ptr<CancellationToken> Inherit();
+	// 実行前のファイバーにトークンを設定
+	static void SetFor(Fiber* fiber, std::shared_ptr<CancellationToken> token);
+
+private:
+	std::atomic<bool> m_cancelled{false};
+	// m_waiter・m_children を保護
+	std::mutex m_mutex;
+	// 現在の待機を中断する処理
+	std::function<void()> m_waiter;
+	std::vector<std::weak_ptr<CancellationToken>> m_children;
+	// 前回の整理後の子トークン数 -> この倍を超えたら破棄済みのものを取り除く
+	size_t m_childrenPruned = 0;
+};
+
+}
+
+#endif
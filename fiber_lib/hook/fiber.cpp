@@ -1,4 +1,14 @@
 #include "fiber.h"
+#include "thread.h"
+#include "scheduler.h"
+
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/mman.h>
+#include <sched.h>
 
 static bool debug = false;
 
@@ -12,11 +22,191 @@ static thread_local Fiber* t_fiber = nullptr;
 static thread_local std::shared_ptr<Fiber> t_thread_fiber = nullptr;
 // スケジューラコルーチン
 static thread_local Fiber* t_scheduler_fiber = nullptr;
+// 直前に実行権を譲ったコルーチンと公開する状態 -> 切り替え先で設定する
+static thread_local Fiber* t_prev = nullptr;
+static thread_local Fiber::State t_prevState = Fiber::READY;
+// yieldTo() の切り替え元 -> 切り替え先で準備完了キューに戻す
+static thread_local std::shared_ptr<Fiber> t_requeue = nullptr;
+// yieldTo() の切り替え先 -> スケジューラコルーチンに戻るまで保持する
+static thread_local std::shared_ptr<Fiber> t_transferred = nullptr;
 
 // コルーチンカウンタ
 static std::atomic<uint64_t> s_fiber_id{0};
 // コルーチンID
 static std::atomic<uint64_t> s_fiber_count{0};
+// 確保済みのファイバーローカル変数のスロット数
+static std::atomic<size_t> s_local_count{0};
+
+// スタックの確保
+// mmap(MAP_NORESERVE) で予約のみ行う -> 物理ページは実際に使われたときに割り当てられる
+// 最下位ページはガードページ -> オーバーフローは他のメモリを壊さずに SIGSEGV になる
+class StackAllocator
+{
+public:
+	// プールに残しても常駐させておく上位の領域（スタックは上から使われる）
+	static const size_t LOW_WATER = 16 * 1024;
+	// スレッドごとにプールしておくスタック数の上限
+	static const size_t MAX_POOLED = 64;
+
+	static size_t PageSize()
+	{
+		static const size_t page = sysconf(_SC_PAGESIZE);
+		return page;
+	}
+
+	static size_t RoundUp(size_t size)
+	{
+		size_t page = PageSize();
+		return (size + page - 1) / page * page;
+	}
+
+	// size は RoundUp() 済み
+	static void* Alloc(size_t size)
+	{
+		if(!t_poolClosed)
+		{
+			Pool& pool = t_pool;
+			for(size_t i = 0; i < pool.stacks.size(); i++)
+			{
+				if(pool.stacks[i].second == size)
+				{
+					void* stack = pool.stacks[i].first;
+					pool.stacks[i] = pool.stacks.back();
+					pool.stacks.pop_back();
+					return stack;
+				}
+			}
+		}
+
+		size_t page = PageSize();
+		char* base = (char*)mmap(nullptr, size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(base == MAP_FAILED)
+		{
+			std::cerr << "StackAllocator::Alloc() mmap failed: " << strerror(errno) << std::endl;
+			throw std::bad_alloc();
+		}
+		mprotect(base, page, PROT_NONE);
+		return base + page;
+	}
+
+	// プールに戻す -> 低水位より下のページは返却する
+	static void Free(void* stack, size_t size)
+	{
+		// スレッド終了後（thread_local・静的変数の破棄中）-> プールは破棄済み
+		if(t_poolClosed)
+		{
+			Unmap(stack, size);
+			return;
+		}
+
+		Release(stack, size);
+
+		Pool& pool = t_pool;
+		if(pool.stacks.size() < MAX_POOLED)
+		{
+			pool.stacks.emplace_back(stack, size);
+		}
+		else
+		{
+			Unmap(stack, size);
+		}
+	}
+
+	// 上位 LOW_WATER 以外のページを返却する -> 予約は残る
+	static void Release(void* stack, size_t size)
+	{
+		if(size <= LOW_WATER)
+		{
+			return;
+		}
+		size_t len = (size - LOW_WATER) / PageSize() * PageSize();
+		if(len == 0)
+		{
+			return;
+		}
+#ifdef MADV_FREE
+		if(madvise(stack, len, MADV_FREE) == 0)
+		{
+			return;
+		}
+#endif
+		// MADV_FREE 非対応のカーネル
+		madvise(stack, len, MADV_DONTNEED);
+	}
+
+	static void Unmap(void* stack, size_t size)
+	{
+		size_t page = PageSize();
+		munmap((char*)stack - page, size + page);
+	}
+
+private:
+	struct Pool
+	{
+		std::vector<std::pair<void*, size_t>> stacks;
+
+		~Pool()
+		{
+			t_poolClosed = true;
+			for(auto& i : stacks)
+			{
+				Unmap(i.first, i.second);
+			}
+		}
+	};
+	static thread_local Pool t_pool;
+	// t_pool の破棄後も参照できるようにデストラクタを持たない型にする
+	static thread_local bool t_poolClosed;
+};
+
+thread_local StackAllocator::Pool StackAllocator::t_pool;
+thread_local bool StackAllocator::t_poolClosed = false;
+
+// スレッドごとの共有スタック
+struct SharedStack
+{
+	static const size_t SIZE = 1024 * 1024;
+
+	char* base = nullptr;
+	// 現在スタック上に内容があるファイバー -> 別スレッドで破棄されても安全なように weak_ptr
+	std::weak_ptr<Fiber> occupant;
+	// このスタックに固定された終了していないファイバー数 -> スレッドの終了後に減らされても安全なように共有する
+	std::shared_ptr<std::atomic<size_t>> pins = std::make_shared<std::atomic<size_t>>(0);
+
+	~SharedStack()
+	{
+		if(base)
+		{
+			StackAllocator::Unmap(base, SIZE);
+		}
+	}
+};
+static thread_local SharedStack t_shared_stack;
+
+// スタック使用量の計測
+static std::atomic<bool> s_stack_profiling{false};
+// 学習したサイズでスタックを作成する -> 明示的に有効にした場合のみ
+static std::atomic<bool> s_stack_autosize{false};
+static const unsigned char STACK_PAINT = 0xA5;
+// 推奨サイズを出すのに必要な計測数
+static const uint64_t STACK_PROFILE_MIN_SAMPLES = 16;
+// デフォルトのスタックサイズ
+static const size_t DEFAULT_STACK_SIZE = 128000;
+// 推奨サイズの下限 -> 計測で通らなかった深い経路のために余裕を残す
+static const size_t MIN_STACK_CLASS = DEFAULT_STACK_SIZE / 4;
+
+struct StackProfile
+{
+	// 最大使用量
+	size_t maxUsed = 0;
+	// 計測したスタックのサイズ
+	size_t stacksize = 0;
+	uint64_t samples = 0;
+	// スタックを使い切った（オーバーフローの疑い）
+	bool overflow = false;
+};
+static std::mutex s_profile_mutex;
+static std::unordered_map<std::string, StackProfile> s_profiles;
 
 void Fiber::SetThis(Fiber *f)
 {
@@ -39,6 +229,59 @@ std::shared_ptr<Fiber> Fiber::GetThis()
 	return t_fiber->shared_from_this();
 }
 
+Fiber* Fiber::GetThisRaw()
+{
+	if(t_fiber)
+	{
+		return t_fiber;
+	}
+	// メインコルーチンを作成
+	GetThis();
+	return t_fiber;
+}
+
+Fiber* Fiber::PeekThis()
+{
+	return t_fiber;
+}
+
+size_t Fiber::AllocLocalSlot()
+{
+	size_t index = s_local_count++;
+	if(index >= MAX_LOCALS)
+	{
+		std::cerr << "AllocLocalSlot() failed: more than " << MAX_LOCALS << " FiberLocal variables\n";
+		throw std::logic_error("too many FiberLocal variables");
+	}
+	return index;
+}
+
+void Fiber::setLocal(size_t index, void* value, void (*dtor)(void*))
+{
+	assert(index < MAX_LOCALS);
+	LocalSlot& slot = m_locals[index];
+	if(slot.value && slot.dtor)
+	{
+		slot.dtor(slot.value);
+	}
+	slot.value = value;
+	slot.dtor = dtor;
+}
+
+void Fiber::clearLocals()
+{
+	for(size_t i = 0; i < MAX_LOCALS; i++)
+	{
+		LocalSlot& slot = m_locals[i];
+		if(slot.value && slot.dtor)
+		{
+			slot.dtor(slot.value);
+		}
+		slot.value = nullptr;
+		slot.dtor = nullptr;
+	}
+}
+
 void Fiber::SetSchedulerFiber(Fiber* f)
 {
 	t_scheduler_fiber = f;
@@ -69,25 +312,30 @@ Fiber::Fiber()
 	if(debug) std::cout << "Fiber(): main id = " << m_id << std::endl;
 }
 
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler):
-m_cb(cb), m_runInScheduler(run_in_scheduler)
+Fiber::Fiber(UniqueFunction cb, size_t stacksize, bool run_in_scheduler, bool shared_stack):
+m_cb(std::move(cb)), m_runInScheduler(run_in_scheduler), m_sharedStack(shared_stack)
 {
 	m_state = READY;
 
-	// コルーチンのスタック領域を割り当てる
-	m_stacksize = stacksize ? stacksize : 128000;
-	m_stack = malloc(m_stacksize);
-
 	if(getcontext(&m_ctx))
 	{
-		std::cerr << "Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler) failed\n";
+		std::cerr << "Fiber(UniqueFunction cb, size_t stacksize, bool run_in_scheduler) failed\n";
 		pthread_exit(NULL);
 	}
-	
-	m_ctx.uc_link = nullptr;
-	m_ctx.uc_stack.ss_sp = m_stack;
-	m_ctx.uc_stack.ss_size = m_stacksize;
-	makecontext(&m_ctx, &Fiber::MainFunc, 0);
+
+	// 共有スタック -> 実行するスレッドが決まる最初の resume() で makecontext する
+	if(!m_sharedStack)
+	{
+		// コルーチンのスタック領域を割り当てる
+		m_stacksize = StackAllocator::RoundUp(stacksize ? stacksize : DEFAULT_STACK_SIZE);
+		m_stack = StackAllocator::Alloc(m_stacksize);
+		paintStack();
+
+		m_ctx.uc_link = nullptr;
+		m_ctx.uc_stack.ss_sp = m_stack;
+		m_ctx.uc_stack.ss_size = m_stacksize;
+		makecontext(&m_ctx, &Fiber::MainFunc, 0);
+	}
 	
 	m_id = s_fiber_id++;
 	s_fiber_count ++;
@@ -96,20 +344,29 @@ m_cb(cb), m_runInScheduler(run_in_scheduler)
 
 Fiber::~Fiber()
 {
+	clearLocals();
+	unpinSharedStack();
 	s_fiber_count --;
 	if(m_stack)
 	{
-		free(m_stack);
+		StackAllocator::Free(m_stack, m_stacksize);
+	}
+	if(m_saveBuf)
+	{
+		free(m_saveBuf);
 	}
 	if(debug) std::cout << "~Fiber(): id = " << m_id << std::endl;	
 }
 
-void Fiber::reset(std::function<void()> cb)
+void Fiber::reset(UniqueFunction cb)
 {
-	assert(m_stack != nullptr&&m_state == TERM);
+	assert((m_stack != nullptr || m_sharedStack)&&m_state == TERM);
 
 	m_state = READY;
-	m_cb = cb;
+	m_cb = std::move(cb);
+	m_priority = -1;
+	m_deadline = std::chrono::steady_clock::time_point();
+	clearLocals();
 
 	if(getcontext(&m_ctx))
 	{
@@ -117,17 +374,62 @@ void Fiber::reset(std::function<void()> cb)
 		pthread_exit(NULL);
 	}
 
+	// 共有スタック -> 内容は不要になった -> 次の resume() で改めてスレッドに固定する
+	if(m_sharedStack)
+	{
+		// 固定先のスレッド -> 占有を解除する（他のスレッドからは saveSharedStack() が固定先を見て退避しない）
+		if(m_stackThread == Thread::GetThreadId() && t_shared_stack.occupant.lock().get() == this)
+		{
+			t_shared_stack.occupant.reset();
+		}
+		unpinSharedStack();
+		m_stackThread = -1;
+		m_saveSize = 0;
+		return;
+	}
+
+	// 前回の実行で使われたページのうち低水位より下を返却する
+	StackAllocator::Release(m_stack, m_stacksize);
+	paintStack();
+
 	m_ctx.uc_link = nullptr;
 	m_ctx.uc_stack.ss_sp = m_stack;
 	m_ctx.uc_stack.ss_size = m_stacksize;
 	makecontext(&m_ctx, &Fiber::MainFunc, 0);
 }
 
+bool Fiber::claim()
+{
+	State expected = READY;
+	int spins = 0;
+	while(!m_state.compare_exchange_weak(expected, RUNNING, std::memory_order_acquire, std::memory_order_relaxed))
+	{
+		if(expected == TERM)
+		{
+			return false;
+		}
+		// 他のスレッドで実行中・切り替え中 -> READY が公開されるまで待つ
+		expected = READY;
+		if(++spins > 100)
+		{
+			sched_yield();
+		}
+	}
+	return true;
+}
+
 void Fiber::resume()
 {
-	assert(m_state==READY);
-	
-	m_state = RUNNING;
+	// 終了済み -> 何もしない
+	if(!claim())
+	{
+		return;
+	}
+
+	if(m_sharedStack)
+	{
+		restoreSharedStack();
+	}
 
 	if(m_runInScheduler)
 	{
@@ -136,7 +438,9 @@ void Fiber::resume()
 		{
 			std::cerr << "resume() to t_scheduler_fiber failed\n";
 			pthread_exit(NULL);
-		}		
+		}
+		FinishSwitch();
+		t_transferred = nullptr;
 	}
 	else
 	{
@@ -145,18 +449,23 @@ void Fiber::resume()
 		{
 			std::cerr << "resume() to t_thread_fiber failed\n";
 			pthread_exit(NULL);
-		}	
+		}
+		FinishSwitch();
 	}
 }
 
 void Fiber::yield()
 {
-	assert(m_state==RUNNING || m_state==TERM);
+	switchOut(READY);
+}
 
-	if(m_state!=TERM)
-	{
-		m_state = READY;
-	}
+void Fiber::switchOut(State state)
+{
+	assert(m_state==RUNNING);
+
+	// 自分の状態は切り替え先で公開する -> 保存前のコンテキストを他のスレッドが再開しないように
+	t_prev = this;
+	t_prevState = state;
 
 	if(m_runInScheduler)
 	{
@@ -175,22 +484,258 @@ void Fiber::yield()
 			std::cerr << "yield() to t_thread_fiber failed\n";
 			pthread_exit(NULL);
 		}	
-	}	
+	}
+	FinishSwitch();
+}
+
+bool Fiber::yieldTo(std::shared_ptr<Fiber> target)
+{
+	assert(m_state==RUNNING);
+	assert(target && target.get()!=this);
+	assert(m_runInScheduler && target->m_runInScheduler);
+	assert(Scheduler::GetThis() && !t_requeue);
+
+	// 共有スタック -> 直接切り替えるとスタックを上書きしてしまう -> スケジューラ経由で実行する
+	if(m_sharedStack || target->m_sharedStack)
+	{
+		t_requeue = shared_from_this();
+		Scheduler::GetThis()->scheduleLock(target);
+		yield();
+		return true;
+	}
+
+	// 切り替え中の target -> 保存が終わるまで待つ 終了済み -> 切り替えずに実行を続ける
+	if(!target->claim())
+	{
+		return false;
+	}
+
+	// 自分は切り替えが終わってからキューに戻す
+	t_requeue = shared_from_this();
+	t_prev = this;
+	t_prevState = READY;
+
+	Fiber* next = target.get();
+	t_transferred = std::move(target);
+	SetThis(next);
+	if(swapcontext(&m_ctx, &next->m_ctx))
+	{
+		std::cerr << "yieldTo() failed\n";
+		pthread_exit(NULL);
+	}
+	FinishSwitch();
+	return true;
+}
+
+void Fiber::FinishSwitch()
+{
+	// 切り替え元の保存は完了した -> 状態を公開する
+	if(t_prev)
+	{
+		Fiber* prev = t_prev;
+		t_prev = nullptr;
+		prev->m_state.store(t_prevState, std::memory_order_release);
+	}
+
+	if(t_requeue)
+	{
+		std::shared_ptr<Fiber> prev = std::move(t_requeue);
+		t_requeue = nullptr;
+		Scheduler::GetThis()->scheduleLock(prev);
+	}
+}
+
+void Fiber::restoreSharedStack()
+{
+	// 呼び出し元が共有スタック上にいると上書きしてしまう
+	assert(!t_fiber || !t_fiber->m_sharedStack);
+
+	SharedStack& ss = t_shared_stack;
+	if(!ss.base)
+	{
+		ss.base = (char*)StackAllocator::Alloc(SharedStack::SIZE);
+	}
+
+	// 初回 -> このスレッドの共有スタックに固定する
+	if(m_stackThread == -1)
+	{
+		m_stackThread = Thread::GetThreadId();
+		m_stackPins = ss.pins;
+		++*m_stackPins;
+		m_ctx.uc_link = nullptr;
+		m_ctx.uc_stack.ss_sp = ss.base;
+		m_ctx.uc_stack.ss_size = SharedStack::SIZE;
+		makecontext(&m_ctx, &Fiber::MainFunc, 0);
+	}
+	assert(m_stackThread == Thread::GetThreadId());
+
+	std::shared_ptr<Fiber> occupant = ss.occupant.lock();
+	if(occupant.get() == this)
+	{
+		// 内容はまだスタック上にある
+		return;
+	}
+	if(occupant)
+	{
+		occupant->saveSharedStack();
+	}
+
+	if(m_saveSize)
+	{
+		memcpy(ss.base + SharedStack::SIZE - m_saveSize, m_saveBuf, m_saveSize);
+	}
+	ss.occupant = shared_from_this();
+}
+
+void Fiber::unpinSharedStack()
+{
+	if(m_stackPins)
+	{
+		--*m_stackPins;
+		m_stackPins.reset();
+	}
+}
+
+size_t Fiber::GetPinnedCount()
+{
+	return *t_shared_stack.pins;
+}
+
+void Fiber::saveSharedStack()
+{
+	// reset() 後に別のスレッドへ固定された（または未固定）-> このスレッドのスタックに内容はない
+	if(m_stackThread != Thread::GetThreadId())
+	{
+		return;
+	}
+
+	// 終了済み -> 内容は不要
+	if(m_state == TERM)
+	{
+		m_saveSize = 0;
+		return;
+	}
+
+	char* top = t_shared_stack.base + SharedStack::SIZE;
+#if defined(__x86_64__)
+	// swapcontext が保存したスタックポインタから上が使用中の領域
+	char* sp = (char*)m_ctx.uc_mcontext.gregs[REG_RSP];
+#else
+	char* sp = t_shared_stack.base;
+#endif
+	assert(sp >= t_shared_stack.base && sp <= top);
+
+	m_saveSize = top - sp;
+	if(m_saveCapacity < m_saveSize)
+	{
+		m_saveBuf = (char*)realloc(m_saveBuf, m_saveSize);
+		m_saveCapacity = m_saveSize;
+	}
+	memcpy(m_saveBuf, sp, m_saveSize);
+}
+
+void Fiber::SetStackProfiling(bool enable)
+{
+	s_stack_profiling = enable;
+}
+
+bool Fiber::IsStackProfiling()
+{
+	return s_stack_profiling;
+}
+
+void Fiber::SetStackAutoSize(bool enable)
+{
+	s_stack_autosize = enable;
+}
+
+bool Fiber::IsStackAutoSize()
+{
+	return s_stack_autosize;
+}
+
+size_t Fiber::GetRecommendedStackSize(const UniqueFunction& cb)
+{
+	if(!s_stack_profiling || !cb)
+	{
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> lock(s_profile_mutex);
+	auto it = s_profiles.find(cb.callsite());
+	if(it == s_profiles.end() || it->second.samples < STACK_PROFILE_MIN_SAMPLES)
+	{
+		return 0;
+	}
+
+	const StackProfile& profile = it->second;
+	// 使い切った -> 倍にする / それ以外 -> 最大使用量の1.5倍を含むサイズクラス（下限から倍々）
+	size_t need = profile.overflow ? profile.stacksize * 2 : profile.maxUsed + profile.maxUsed / 2;
+	size_t size = MIN_STACK_CLASS;
+	while(size < need)
+	{
+		size *= 2;
+	}
+	return size;
+}
+
+void Fiber::DumpStackProfile(std::ostream& os)
+{
+	std::lock_guard<std::mutex> lock(s_profile_mutex);
+	for(auto& i : s_profiles)
+	{
+		os << i.first << ": max used = " << i.second.maxUsed << " / " << i.second.stacksize 
+			<< ", samples = " << i.second.samples << (i.second.overflow ? ", overflow" : "") << "\n";
+	}
+}
+
+void Fiber::paintStack()
+{
+	m_painted = s_stack_profiling && m_stack;
+	if(m_painted)
+	{
+		memset(m_stack, STACK_PAINT, m_stacksize);
+	}
+}
+
+void Fiber::recordStackUsage(const std::string& callsite)
+{
+	// スタックは下位アドレスに伸びる -> 下から塗られたままの領域を数える
+	const unsigned char* p = (const unsigned char*)m_stack;
+	size_t untouched = 0;
+	while(untouched < m_stacksize && p[untouched] == STACK_PAINT)
+	{
+		untouched++;
+	}
+	size_t used = m_stacksize - untouched;
+
+	std::lock_guard<std::mutex> lock(s_profile_mutex);
+	StackProfile& profile = s_profiles[callsite];
+	profile.maxUsed = std::max(profile.maxUsed, used);
+	profile.stacksize = std::max(profile.stacksize, (size_t)m_stacksize);
+	profile.overflow = profile.overflow || untouched == 0;
+	profile.samples++;
 }
 
 void Fiber::MainFunc()
 {
-	std::shared_ptr<Fiber> curr = GetThis();
+	// 所有権は再開した側（run() のタスク・yieldTo() の切り替え元）が持つ -> 参照カウントは操作しない
+	Fiber* curr = GetThisRaw();
 	assert(curr!=nullptr);
+	FinishSwitch();
 
 	curr->m_cb(); 
+	if(curr->m_painted)
+	{
+		curr->recordStackUsage(curr->m_cb.callsite());
+	}
 	curr->m_cb = nullptr;
-	curr->m_state = TERM;
+	curr->clearLocals();
+	// 終了 -> スタックの内容は不要なので固定先スレッドを引き留めない
+	curr->unpinSharedStack();
 
-	// 実行完了 -> 実行権を譲る
-	auto raw_ptr = curr.get();
-	curr.reset(); 
-	raw_ptr->yield(); 
+	// 実行完了 -> 実行権を譲る -> 切り替え先で TERM が公開される
+	curr->switchOut(TERM);
 }
 
 }
\ No newline at end of file
@@ -5,10 +5,12 @@
 #include <memory>       
 #include <atomic>       
 #include <functional>   
+#include <chrono>
 #include <cassert>      
 #include <ucontext.h>   
 #include <unistd.h>
-#include <mutex>
+
+#include "unique_function.h"
 
 namespace sylar {
 
@@ -28,19 +30,38 @@ private:
 	Fiber();
 
 public:
-	Fiber(std::function<void()> cb, size_t stacksize = 0, bool run_in_scheduler = true);
+	// shared_stack -> 専用スタックを持たず、スレッドごとの共有スタック上で実行する（切り替え時に使用分をコピー）
+	// 最初に実行したスレッドに固定され、TERM になるまで他のスレッドでは再開できない
+	Fiber(UniqueFunction cb, size_t stacksize = 0, bool run_in_scheduler = true, bool shared_stack = false);
 	~Fiber();
 
 	// コルーチンを再利用
-	void reset(std::function<void()> cb);
+	void reset(UniqueFunction cb);
 
 	// タスクスレッドが実行を再開
 	void resume();
 	// タスクスレッドが実行権を譲る
 	void yield();
+	// 実行権を target に直接渡す -> 自分は準備完了キューに戻る（スケジューラコルーチンを経由しない）
+	// target はどのキューにも入っていない READY のコルーチンであること（起床させる責任を引き継ぐ）
+	// target が終了済み -> 切り替えずに false を返す（呼び出し元はそのまま実行を続ける）
+	bool yieldTo(std::shared_ptr<Fiber> target);
 
 	uint64_t getId() const {return m_id;}
-	State getState() const {return m_state;}
+	State getState() const {return m_state.load(std::memory_order_acquire);}
+	// 共有スタックを使うファイバーが固定されたスレッド -1 -> どのスレッドでも再開できる
+	int getStackThread() const {return m_stackThread;}
+	// このスレッドの共有スタックに固定された終了していないファイバー数 -> 0 でなければスレッドを終了できない
+	static size_t GetPinnedCount();
+	// スケジューラのタスクとして実行されるか（メインコルーチン・スケジューラコルーチンは false）
+	bool isRunInScheduler() const {return m_runInScheduler;}
+	// 最後に実行されたときのスケジューラの優先度クラス -1 -> 未設定
+	// 待機からの起床・yield でキューに戻るときに引き継がれる
+	int getPriority() const {return m_priority;}
+	void setPriority(int priority) {m_priority = priority;}
+	// 最後に実行されたときの期限（scheduleDeadline()） -> キューに戻るときに期限付きタスクとして扱われる
+	std::chrono::steady_clock::time_point getDeadline() const {return m_deadline;}
+	void setDeadline(std::chrono::steady_clock::time_point deadline) {m_deadline = deadline;}
 
 public:
 	// 現在実行中のコルーチンを設定
@@ -49,6 +70,12 @@ public:
 	// 現在実行中のコルーチンを取得 
 	static std::shared_ptr<Fiber> GetThis();
 
+	// 現在実行中のコルーチンを取得（参照カウントを操作しない）
+	static Fiber* GetThisRaw();
+
+	// 現在実行中のコルーチンを取得 -> まだなければ nullptr（メインコルーチンを作成しない）
+	static Fiber* PeekThis();
+
 	// スケジューラコルーチンを設定（デフォルトはメインコルーチン）
 	static void SetSchedulerFiber(Fiber* f);
 	
@@ -58,24 +85,139 @@ public:
 	// コルーチン関数
 	static void MainFunc();	
 
+public:
+	// スタック使用量の計測 -> 以後作成・reset() されるスタックをパターンで塗り、
+	// 終了時に呼び出し元（UniqueFunction::callsite()）ごとの最大使用量を記録する
+	// std::bind など型が同じになる呼び出し元は WithCallsite() でタグを付けて区別する
+	static void SetStackProfiling(bool enable);
+	static bool IsStackProfiling();
+	// 学習したサイズクラスでスケジューラのファイバーを作成する -> デフォルトは無効
+	// 計測で通らなかった深い経路はオーバーフローしうる -> 下限はデフォルトサイズの1/4
+	static void SetStackAutoSize(bool enable);
+	static bool IsStackAutoSize();
+	// 記録した最大使用量から求めたサイズクラス -> 計測数が足りなければ0（デフォルトを使う）
+	static size_t GetRecommendedStackSize(const UniqueFunction& cb);
+	// 呼び出し元ごとの最大使用量を出力
+	static void DumpStackProfile(std::ostream& os);
+
+public:
+	// ファイバーローカル変数のスロット数
+	static const size_t MAX_LOCALS = 16;
+
+	// スロット番号を確保 -> FiberLocal の構築時に1度だけ呼ぶ
+	static size_t AllocLocalSlot();
+
+	void* getLocal(size_t index) const {return m_locals[index].value;}
+	// 値を設定 -> TERM・reset()・破棄時に dtor で解放される
+	void setLocal(size_t index, void* value, void (*dtor)(void*));
+
+private:
+	// READY -> RUNNING に遷移する -> 別のスレッドで切り替え中なら完了を待つ 終了済み -> false
+	bool claim();
+	// 実行権を譲る -> state は切り替えが完了してから公開される
+	void switchOut(State state);
+	// 切り替え後処理 -> 切り替え元の状態を公開し、yieldTo() の切り替え元をキューに戻す
+	static void FinishSwitch();
+
+	// すべてのファイバーローカル変数を解放
+	void clearLocals();
+
+	// 共有スタック: 再開前に自分の内容を書き戻す（使用中の別ファイバーは退避する）
+	void restoreSharedStack();
+	// 共有スタック: 固定先スレッドの固定数から外す
+	void unpinSharedStack();
+	// 共有スタック: 使用分を退避する
+	void saveSharedStack();
+
+	// スタックをパターンで塗る / 塗られたままの領域から使用量を求めて記録する
+	void paintStack();
+	void recordStackUsage(const std::string& callsite);
+
+	struct LocalSlot
+	{
+		void* value = nullptr;
+		void (*dtor)(void*) = nullptr;
+	};
+
 private:
 	// ID
 	uint64_t m_id = 0;
 	// スタックサイズ
 	uint32_t m_stacksize = 0;
-	// コルーチン状態
-	State m_state = READY;
+	// コルーチン状態 -> 二重に再開されないように READY -> RUNNING は CAS で遷移する
+	std::atomic<State> m_state{READY};
 	// コルーチンコンテキスト
 	ucontext_t m_ctx;
 	// コルーチンのスタックポインタ
 	void* m_stack = nullptr;
 	// コルーチン関数
-	std::function<void()> m_cb;
+	UniqueFunction m_cb;
 	// 実行権をスケジューラに譲るかどうか
-	bool m_runInScheduler;
+	bool m_runInScheduler = false;
+	// スケジューラの優先度クラス -> 同じファイバーを実行するワーカーだけが書き換える
+	int m_priority = -1;
+	// 期限 -> 0 なら期限なし
+	std::chrono::steady_clock::time_point m_deadline;
+	// ファイバーローカル変数
+	LocalSlot m_locals[MAX_LOCALS];
+
+	// スタックをパターンで塗ったか
+	bool m_painted = false;
+	// 共有スタックを使うか
+	bool m_sharedStack = false;
+	// 共有スタックの固定先スレッド -> 元のスレッドから退避時に読まれる
+	std::atomic<int> m_stackThread = {-1};
+	// 固定先スレッドの固定数 -> 終了・reset()・破棄で減らす
+	std::shared_ptr<std::atomic<size_t>> m_stackPins;
+	// 退避したスタックの内容
+	char* m_saveBuf = nullptr;
+	size_t m_saveSize = 0;
+	size_t m_saveCapacity = 0;
+};
 
+// ファイバーローカル変数 -> ファイバーがスレッド間を移動しても値はファイバーについていく
+// スロット番号は構築時に確定するので、参照はファイバー内の配列を引くだけ
+template <class T>
+class FiberLocal
+{
 public:
-	std::mutex m_mutex;
+	FiberLocal(): m_index(Fiber::AllocLocalSlot()) {}
+
+	FiberLocal(const FiberLocal&) = delete;
+	FiberLocal& operator=(const FiberLocal&) = delete;
+
+	// 現在のファイバーの値 -> 初回アクセス時にデフォルト構築
+	T& get()
+	{
+		Fiber* fiber = Fiber::GetThisRaw();
+		void* value = fiber->getLocal(m_index);
+		if(!value)
+		{
+			value = new T();
+			fiber->setLocal(m_index, value, &FiberLocal::Destroy);
+		}
+		return *static_cast<T*>(value);
+	}
+
+	void set(T value) {get() = std::move(value);}
+	// 指定したファイバーの値を設定 -> 実行前のファイバーに値を渡す
+	void setFor(Fiber* fiber, T value) {fiber->setLocal(m_index, new T(std::move(value)), &FiberLocal::Destroy);}
+
+	// 現在のファイバーの値 -> 未設定・ファイバーのないスレッドなら nullptr（構築しない）
+	T* peek() const
+	{
+		Fiber* fiber = Fiber::PeekThis();
+		return fiber ? static_cast<T*>(fiber->getLocal(m_index)) : nullptr;
+	}
+
+	T& operator*() {return get();}
+	T* operator->() {return &get();}
+
+private:
+	static void Destroy(void* value) {delete static_cast<T*>(value);}
+
+private:
+	const size_t m_index;
 };
 
 }
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <cstdarg>
 #include "fd_manager.h"
+#include "cancellation.h"
 #include <string.h>
 
 // apply XX to all functions
@@ -81,6 +82,96 @@ struct timer_info
     int cancelled = 0;
 };
 
+// register the abort action of the current wait on the fiber's cancellation token
+// false -> already cancelled, don't start waiting
+static bool set_cancel_waiter(const std::shared_ptr<sylar::CancellationToken>& token, std::weak_ptr<timer_info> winfo, int fd, sylar::IOManager* iom, uint32_t event)
+{
+    if(!token) 
+    {
+        return true;
+    }
+    return token->setWaiter([winfo, fd, iom, event]() 
+    {
+        auto t = winfo.lock();
+        if(!t || t->cancelled) 
+        {
+            return;
+        }
+        t->cancelled = ECANCELED;
+        // cancel this event and trigger once to return to this fiber
+        iom->cancelEvent(fd, (sylar::IOManager::Event)(event));
+    });
+}
+
+// sleep of hooked functions -> 0 or -1 with errno = ECANCELED
+static int sleep_ms(uint64_t ms)
+{
+    std::shared_ptr<sylar::Fiber> fiber = sylar::Fiber::GetThis();
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    std::shared_ptr<sylar::CancellationToken> token = sylar::CancellationToken::GetThis();
+
+    // the timer and the cancellation race -> only the first one reschedules this fiber
+    // 0 -> sleeping, ETIMEDOUT -> woken by the timer, ECANCELED -> woken by the cancellation
+    auto wakeup = std::make_shared<std::atomic<int>>(0);
+    // add a timer to reschedule this fiber -> no slack, the default slack is meant for I/O timeouts
+    std::shared_ptr<sylar::Timer> timer = iom->addTimer(ms, [fiber, iom, wakeup]()
+    {
+        int expected = 0;
+        if(wakeup->compare_exchange_strong(expected, ETIMEDOUT)) 
+        {
+            iom->scheduleLock(fiber, -1);
+        }
+    }, false, 0);
+
+    if(token) 
+    {
+        std::weak_ptr<sylar::Timer> wtimer(timer);
+        std::weak_ptr<sylar::Fiber> wfiber(fiber);
+        bool waiting = token->setWaiter([wtimer, wfiber, iom, wakeup]()
+        {
+            int expected = 0;
+            if(!wakeup->compare_exchange_strong(expected, ECANCELED)) 
+            {
+                return;
+            }
+            // unlink the timer now instead of letting it expire
+            auto t = wtimer.lock();
+            if(t) 
+            {
+                t->cancel();
+            }
+            auto f = wfiber.lock();
+            if(f) 
+            {
+                iom->scheduleLock(f, -1);
+            }
+        });
+
+        // already cancelled -> don't wait for the timer
+        int expected = 0;
+        if(!waiting && wakeup->compare_exchange_strong(expected, ECANCELED)) 
+        {
+            timer->cancel();
+            errno = ECANCELED;
+            return -1;
+        }
+    }
+
+    // wait for the next resume
+    fiber->yield();
+
+    if(token) 
+    {
+        token->clearWaiter();
+    }
+    if(*wakeup == ECANCELED) 
+    {
+        errno = ECANCELED;
+        return -1;
+    }
+    return 0;
+}
+
 // universal template for read and write function
 template<typename OriginFun, typename... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t event, int timeout_so, Args&&... args) 
@@ -90,6 +181,9 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t
         return fun(fd, std::forward<Args>(args)...);
     }
 
+    // safe point -> let other fibers run if this one used up its time slice
+    sylar::Scheduler::YieldIfPreempted();
+
     std::shared_ptr<sylar::FdCtx> ctx = sylar::FdMgr::GetInstance()->get(fd);
     if(!ctx) 
     {
@@ -111,6 +205,8 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, uint32_t
     uint64_t timeout = ctx->getTimeout(timeout_so);
     // timer condition
     std::shared_ptr<timer_info> tinfo(new timer_info);
+    // cancellation of this fiber
+    std::shared_ptr<sylar::CancellationToken> token = sylar::CancellationToken::GetThis();
 
 retry:
 	// run the function
@@ -159,15 +255,31 @@ retry:
         } 
         else 
         {
-            sylar::Fiber::GetThis()->yield();
+            // already cancelled -> give the event back and fail at once
+            if(!set_cancel_waiter(token, winfo, fd, iom, event)) 
+            {
+                iom->delEvent(fd, (sylar::IOManager::Event)(event));
+                if(timer) 
+                {
+                    timer->cancel();
+                }
+                errno = ECANCELED;
+                return -1;
+            }
+
+            sylar::Fiber::GetThisRaw()->yield();
      
             // 3 resume either by addEvent or cancelEvent
+            if(token) 
+            {
+                token->clearWaiter();
+            }
             if(timer) 
             {
                 timer->cancel();
             }
-            // by cancelEvent
-            if(tinfo->cancelled == ETIMEDOUT) 
+            // by cancelEvent -> timed out or cancelled
+            if(tinfo->cancelled) 
             {
                 errno = tinfo->cancelled;
                 return -1;
@@ -195,12 +307,11 @@ unsigned int sleep(unsigned int seconds)
 		return sleep_f(seconds);
 	}
 
-	std::shared_ptr<sylar::Fiber> fiber = sylar::Fiber::GetThis();
-	sylar::IOManager* iom = sylar::IOManager::GetThis();
-	// add a timer to reschedule this fiber
-	iom->addTimer(seconds*1000, [fiber, iom](){iom->scheduleLock(fiber, -1);});
-	// wait for the next resume
-	fiber->yield();
+	// cancelled -> nothing slept
+	if(sleep_ms((uint64_t)seconds*1000)) 
+	{
+		return seconds;
+	}
 	return 0;
 }
 
@@ -211,13 +322,7 @@ int usleep(useconds_t usec)
 		return usleep_f(usec);
 	}
 
-	std::shared_ptr<sylar::Fiber> fiber = sylar::Fiber::GetThis();
-	sylar::IOManager* iom = sylar::IOManager::GetThis();
-	// add a timer to reschedule this fiber
-	iom->addTimer(usec/1000, [fiber, iom](){iom->scheduleLock(fiber);});
-	// wait for the next resume
-	fiber->yield();
-	return 0;
+	return sleep_ms(usec/1000);
 }
 
 int nanosleep(const struct timespec* req, struct timespec* rem)
@@ -229,12 +334,14 @@ int nanosleep(const struct timespec* req, struct timespec* rem)
 
 	int timeout_ms = req->tv_sec*1000 + req->tv_nsec/1000/1000;
 
-	std::shared_ptr<sylar::Fiber> fiber = sylar::Fiber::GetThis();
-	sylar::IOManager* iom = sylar::IOManager::GetThis();
-	// add a timer to reschedule this fiber
-	iom->addTimer(timeout_ms, [fiber, iom](){iom->scheduleLock(fiber, -1);});
-	// wait for the next resume
-	fiber->yield();	
+	if(sleep_ms(timeout_ms)) 
+	{
+		if(rem) 
+		{
+			*rem = *req;
+		}
+		return -1;
+	}
 	return 0;
 }
 
@@ -296,6 +403,7 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     std::shared_ptr<sylar::Timer> timer;
     std::shared_ptr<timer_info> tinfo(new timer_info);
     std::weak_ptr<timer_info> winfo(tinfo);
+    std::shared_ptr<sylar::CancellationToken> token = sylar::CancellationToken::GetThis();
 
     if(timeout_ms != (uint64_t)-1) 
     {
@@ -314,9 +422,20 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     int rt = iom->addEvent(fd, sylar::IOManager::WRITE);
     if(rt == 0) 
     {
-        sylar::Fiber::GetThis()->yield();
+        // already cancelled -> abort the wait right away
+        if(!set_cancel_waiter(token, winfo, fd, iom, sylar::IOManager::WRITE)) 
+        {
+            tinfo->cancelled = ECANCELED;
+            iom->cancelEvent(fd, sylar::IOManager::WRITE);
+        }
+
+        sylar::Fiber::GetThisRaw()->yield();
 
         // resume either by addEvent or cancelEvent
+        if(token) 
+        {
+            token->clearWaiter();
+        }
         if(timer) 
         {
             timer->cancel();
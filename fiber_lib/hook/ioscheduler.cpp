@@ -1,7 +1,9 @@
 #include <unistd.h>    
 #include <sys/epoll.h> 
+#include <sys/timerfd.h>
 #include <fcntl.h>     
 #include <cstring>
+#include <chrono>
 
 #include "ioscheduler.h"
 
@@ -16,6 +18,8 @@ IOManager* IOManager::GetThis()
 
 IOManager::FdContext::EventContext& IOManager::FdContext::getEventContext(Event event) 
 {
+    // extended flags (EXCLUSIVE, INLINE) are not event contexts -> mask them off
+    event = (Event)(event & ~(EXCLUSIVE | INLINE));
     assert(event==READ || event==WRITE);    
     switch (event) 
     {
@@ -23,6 +27,8 @@ IOManager::FdContext::EventContext& IOManager::FdContext::getEventContext(Event
         return read;
     case WRITE:
         return write;
+    default:
+        break;
     }
     throw std::invalid_argument("Unsupported event type");
 }
@@ -32,20 +38,42 @@ void IOManager::FdContext::resetEventContext(EventContext &ctx)
     ctx.scheduler = nullptr;
     ctx.fiber.reset();
     ctx.cb = nullptr;
+    ctx.inlined = false;
 }
 
 // no lock
-void IOManager::FdContext::triggerEvent(IOManager::Event event) {
+void IOManager::FdContext::triggerEvent(IOManager::Event event, std::vector<ScheduleTask>* batch) {
     assert(events & event);
 
     // delete event 
     events = (Event)(events & ~event);
+    if (events == NONE) 
+    {
+        flags = NONE;
+    }
     
     // trigger
     EventContext& ctx = getEventContext(event);
-    if (ctx.cb) 
+    if (batch && ctx.scheduler == Scheduler::GetThis()) 
+    {
+        // enqueued later by the idle loop together with the other ready events
+        if (ctx.cb) 
+        {
+            batch->emplace_back(&ctx.cb, -1);
+            batch->back().inlined = ctx.inlined;
+        } 
+        else 
+        {
+            batch->emplace_back(&ctx.fiber, -1);
+        }
+    }
+    else if (ctx.cb && ctx.inlined) 
+    {
+        ctx.scheduler->scheduleInline(std::move(ctx.cb));
+    } 
+    else if (ctx.cb) 
     {
-        // call ScheduleTask(std::function<void()>* f, int thr)
+        // call ScheduleTask(UniqueFunction* f, int thr)
         ctx.scheduler->scheduleLock(&ctx.cb);
     } 
     else 
@@ -92,6 +120,10 @@ IOManager::~IOManager() {
     close(m_epfd);
     close(m_tickleFds[0]);
     close(m_tickleFds[1]);
+    if (m_timerFd >= 0) 
+    {
+        close(m_timerFd);
+    }
 
     for (size_t i = 0; i < m_fdContexts.size(); ++i) 
     {
@@ -117,8 +149,13 @@ void IOManager::contextResize(size_t size)
     }
 }
 
-int IOManager::addEvent(int fd, Event event, std::function<void()> cb) 
+int IOManager::addEvent(int fd, Event event, UniqueFunction cb) 
 {
+    // split the extended flags from the event itself
+    Event flags     = (Event)(event & EXCLUSIVE);
+    bool run_inline = event & INLINE;
+    event           = (Event)(event & ~(EXCLUSIVE | INLINE));
+
     // attemp to find FdContext 
     FdContext *fd_ctx = nullptr;
     
@@ -137,6 +174,19 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
     }
 
     std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+
+    // the socket polls the device queue itself while this reactor spins
+    if (m_socketBusyPoll && !fd_ctx->busyPoll) 
+    {
+        int busy_us = (int)m_busyPollMaxUs;
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_us, sizeof(busy_us));
+#ifdef SO_PREFER_BUSY_POLL
+        int prefer = 1;
+        setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#endif
+        // failures (not a socket, no CAP_NET_ADMIN) are ignored -> try only once per fd
+        fd_ctx->busyPoll = true;
+    }
     
     // the event has already been added
     if(fd_ctx->events & event) 
@@ -144,10 +194,17 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
         return -1;
     }
 
+    // EPOLLEXCLUSIVE is only accepted by EPOLL_CTL_ADD -> can't share the fd with another event
+    if((flags | fd_ctx->flags) && fd_ctx->events) 
+    {
+        std::cerr << "addEvent: EXCLUSIVE can't be combined with other events, fd = " << fd << std::endl; 
+        return -1;
+    }
+
     // add new event
     int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
     epoll_event epevent;
-    epevent.events   = EPOLLET | fd_ctx->events | event;
+    epevent.events   = EPOLLET | fd_ctx->events | event | flags;
     epevent.data.ptr = fd_ctx;
 
     int rt = epoll_ctl(m_epfd, op, fd, &epevent);
@@ -161,6 +218,7 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
 
     // update fdcontext
     fd_ctx->events = (Event)(fd_ctx->events | event);
+    fd_ctx->flags  = flags;
 
     // update event context
     FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);
@@ -169,6 +227,7 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
     if (cb) 
     {
         event_ctx.cb.swap(cb);
+        event_ctx.inlined = run_inline;
     } 
     else 
     {
@@ -221,6 +280,10 @@ bool IOManager::delEvent(int fd, Event event) {
 
     // update fdcontext
     fd_ctx->events = new_events;
+    if (new_events == NONE) 
+    {
+        fd_ctx->flags = NONE;
+    }
 
     // update event context
     FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);
@@ -290,6 +353,9 @@ bool IOManager::cancelAll(int fd) {
     }
 
     std::lock_guard<std::mutex> lock(fd_ctx->mutex);
+
+    // cancelAll() is called from close() -> the next fd with this number is a new socket
+    fd_ctx->busyPoll = false;
     
     // none of events exist
     if (!fd_ctx->events) 
@@ -340,9 +406,8 @@ void IOManager::tickle()
 
 bool IOManager::stopping() 
 {
-    uint64_t timeout = getNextTimer();
     // no timers left and no pending events left with the Scheduler::stopping()
-    return timeout == ~0ull && m_pendingEventCount == 0 && Scheduler::stopping();
+    return !hasTimer() && m_pendingEventCount == 0 && Scheduler::stopping();
 }
 
 
@@ -350,26 +415,76 @@ void IOManager::idle()
 {    
     static const uint64_t MAX_EVNETS = 256;
     std::unique_ptr<epoll_event[]> events(new epoll_event[MAX_EVNETS]);
+    // tasks woken during one turn -> enqueued at once
+    std::vector<ScheduleTask> tasks;
+    std::vector<std::function<void()>> cbs;
+    // adaptive busy-poll budget of this thread
+    uint64_t budget_us = m_busyPollMaxUs;
+    // timers added by this thread go to its own shard from now on
+    // timerfd -> every timer stays in the shared shard, which the timerfd covers
+    if (m_timerFd < 0) 
+    {
+        claimShard();
+    }
 
     while (true) 
     {
         if(debug) std::cout << "IOManager::idle(),run in thread: " << Thread::GetThreadId() << std::endl; 
 
-        if(stopping()) 
+        if(stopping() || retiring()) 
         {
             if(debug) std::cout << "name = " << getName() << " idle exits in thread: " << Thread::GetThreadId() << std::endl;
+            // hand the remaining timers over to the threads still running
+            releaseShard();
+            // the last timer may have expired in this thread's shard while the others
+            // wait on their own ones -> wake them up one after another
+            if(stopping())
+            {
+                tickle();
+            }
             break;
         }
 
-        // blocked at epoll_wait
+        // timerfd enabled after this thread claimed its shard
+        if (m_timerFd >= 0) 
+        {
+            releaseShard();
+        }
+
+        // spin first if busy-polling is enabled and no timer is due
         int rt = 0;
-        while(true)
+        if (m_busyPollMaxUs) 
+        {
+            auto next_timer = getNextDeadline();
+            if (next_timer > std::chrono::system_clock::now()) 
+            {
+                rt = busyPoll(events.get(), MAX_EVNETS, budget_us, next_timer);
+            }
+        }
+
+        // blocked at epoll_wait
+        while(rt <= 0)
         {
             static const uint64_t MAX_TIMEOUT = 5000;
-            uint64_t next_timeout = getNextTimer();
-            next_timeout = std::min(next_timeout, MAX_TIMEOUT);
+            // a surplus thread wakes up when its keep-alive runs out so that it can retire
+            uint64_t retire_timeout = retireWaitMs();
+            int timeout = -1;
+            if (m_timerFd >= 0) 
+            {
+                // the timerfd wakes one thread up at the earliest deadline
+                armTimerFd();
+                if (retire_timeout != UINT64_MAX) 
+                {
+                    timeout = (int)std::min(retire_timeout, MAX_TIMEOUT);
+                }
+            }
+            else 
+            {
+                uint64_t next_timeout = getNextTimer();
+                timeout = (int)std::min({next_timeout, retire_timeout, MAX_TIMEOUT});
+            }
 
-            rt = epoll_wait(m_epfd, events.get(), MAX_EVNETS, (int)next_timeout);
+            rt = epoll_wait(m_epfd, events.get(), MAX_EVNETS, timeout);
             // EINTR -> retry
             if(rt < 0 && errno == EINTR) 
             {
@@ -382,16 +497,12 @@ void IOManager::idle()
         };
 
         // collect all timers overdue
-        std::vector<std::function<void()>> cbs;
         listExpiredCb(cbs);
-        if(!cbs.empty()) 
+        for(auto& cb : cbs) 
         {
-            for(const auto& cb : cbs) 
-            {
-                scheduleLock(cb);
-            }
-            cbs.clear();
+            tasks.emplace_back(std::move(cb), -1);
         }
+        cbs.clear();
         
         // collect all events ready
         for (int i = 0; i < rt; ++i) 
@@ -407,6 +518,14 @@ void IOManager::idle()
                 continue;
             }
 
+            // timerfd event -> the expired timers were collected above
+            if (event.data.fd == m_timerFd) 
+            {
+                uint64_t expirations;
+                while (read(m_timerFd, &expirations, sizeof(expirations)) > 0);
+                continue;
+            }
+
             // other events
             FdContext *fd_ctx = (FdContext *)event.data.ptr;
             std::lock_guard<std::mutex> lock(fd_ctx->mutex);
@@ -447,24 +566,220 @@ void IOManager::idle()
             // schedule callback and update fdcontext and event context
             if (real_events & READ) 
             {
-                fd_ctx->triggerEvent(READ);
+                fd_ctx->triggerEvent(READ, &tasks);
                 --m_pendingEventCount;
             }
             if (real_events & WRITE) 
             {
-                fd_ctx->triggerEvent(WRITE);
+                fd_ctx->triggerEvent(WRITE, &tasks);
                 --m_pendingEventCount;
             }
         } // end for
 
-        Fiber::GetThis()->yield();
+        // one lock and only the wakeups needed for the whole turn
+        if (!tasks.empty()) 
+        {
+            scheduleTasks(tasks);
+        }
+
+        // no longer waiting -> the other idle threads count this thread's shard in again
+        leaveTimerWait(false);
+        Fiber::GetThisRaw()->yield();
   
     } // end while(true)
 }
 
+void IOManager::setBusyPoll(uint64_t max_us, bool socket_busy_poll) 
+{
+    m_busyPollMaxUs  = max_us;
+    m_socketBusyPoll = socket_busy_poll && max_us > 0;
+}
+
+IOManager::BusyPollStats IOManager::getBusyPollStats() const 
+{
+    BusyPollStats stats;
+    stats.spinNs = m_busyPollNs;
+    stats.hits   = m_busyPollHits;
+    stats.misses = m_busyPollMisses;
+
+    uint64_t total = 0;
+    uint64_t buckets[32];
+    for (int i = 0; i < 32; ++i) 
+    {
+        buckets[i] = m_busyPollLatency[i];
+        total += buckets[i];
+    }
+
+    // upper bound of the bucket holding the given rank
+    auto percentile = [&](double p) -> uint64_t 
+    {
+        uint64_t rank = (uint64_t)(total * p);
+        uint64_t seen = 0;
+        for (int i = 0; i < 32; ++i) 
+        {
+            seen += buckets[i];
+            if (seen > rank) 
+            {
+                return (1ull << (i + 1));
+            }
+        }
+        return 0;
+    };
+    stats.p50Us = percentile(0.50);
+    stats.p90Us = percentile(0.90);
+    stats.p99Us = percentile(0.99);
+    return stats;
+}
+
+int IOManager::busyPoll(epoll_event *events, int max_events, uint64_t &budget_us, std::chrono::system_clock::time_point next_timer) 
+{
+    uint64_t max_us = m_busyPollMaxUs;
+    // never shrink below 1/8 of the limit -> keeps probing whether spinning pays off
+    uint64_t min_us = std::max<uint64_t>(max_us / 8, 1);
+    budget_us = std::min(std::max(budget_us, min_us), max_us);
+
+    auto start    = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::microseconds(budget_us);
+    // never spin past the next timer -> it would fire up to a whole budget late
+    bool capped = false;
+    if (next_timer != std::chrono::system_clock::time_point::max()) 
+    {
+        auto timer_at = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(next_timer - std::chrono::system_clock::now());
+        if (timer_at < deadline) 
+        {
+            deadline = timer_at;
+            capped   = true;
+        }
+    }
+    int rt = 0;
+    auto now = start;
+    do 
+    {
+        // new tasks tickle the pipe -> polling epoll alone also notices the run queue
+        rt = epoll_wait(m_epfd, events, max_events, 0);
+        now = std::chrono::steady_clock::now();
+    } while (rt <= 0 && now < deadline);
+
+    uint64_t spin_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count();
+    m_busyPollNs.fetch_add(spin_ns, std::memory_order_relaxed);
+
+    if (rt > 0) 
+    {
+        ++m_busyPollHits;
+        uint64_t us = spin_ns / 1000;
+        int bucket = 0;
+        while (us > 1 && bucket < 31) 
+        {
+            us >>= 1;
+            ++bucket;
+        }
+        m_busyPollLatency[bucket].fetch_add(1, std::memory_order_relaxed);
+        // spinning paid off -> grow the budget
+        budget_us = std::min(budget_us * 2, max_us);
+    } 
+    else 
+    {
+        ++m_busyPollMisses;
+        // nothing arrived within the budget -> halve it to save CPU
+        // cut short by a timer -> says nothing about the budget, keep it
+        if (!capped) 
+        {
+            budget_us = std::max(budget_us / 2, min_us);
+        }
+    }
+    return rt;
+}
+
+void IOManager::leaveIdle() 
+{
+    // about to run tasks -> an idle thread expires this thread's timers if they come due meanwhile
+    leaveTimerWait(true);
+}
+
 void IOManager::onTimerInsertedAtFront() 
 {
+    if (m_timerFd >= 0) 
+    {
+        armTimerFd();
+        return;
+    }
     tickle();
 }
 
+bool IOManager::enableTimerFd() 
+{
+    {
+        std::lock_guard<std::mutex> lock(m_timerFdMutex);
+        if (m_timerFd >= 0) 
+        {
+            return true;
+        }
+
+        // CLOCK_REALTIME -> deadlines are kept on the system clock
+        int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0) 
+        {
+            std::cerr << "enableTimerFd::timerfd_create failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        epoll_event event;
+        event.events  = EPOLLIN | EPOLLET;
+        event.data.fd = fd;
+        if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &event)) 
+        {
+            std::cerr << "enableTimerFd::epoll_ctl failed: " << strerror(errno) << std::endl;
+            close(fd);
+            return false;
+        }
+        m_timerFd = fd;
+    }
+
+    armTimerFd();
+    return true;
+}
+
+void IOManager::armTimerFd() 
+{
+    // getNextDeadline() resets the tickle flag first -> a timer inserted after this read arms again
+    auto next = getNextDeadline();
+    int64_t ns = timerFdDeadline(next);
+
+    // already armed with a deadline still ahead of us -> every idle turn ends here without the lock
+    if (ns == m_timerFdArmed.load(std::memory_order_acquire) && (ns == 0 || next > std::chrono::system_clock::now())) 
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_timerFdMutex);
+    // another thread may have armed it meanwhile -> read the deadline again under the lock
+    next = getNextDeadline();
+    ns   = timerFdDeadline(next);
+    if (ns == m_timerFdArmed.load(std::memory_order_relaxed) && (ns == 0 || next > std::chrono::system_clock::now())) 
+    {
+        return;
+    }
+
+    itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec  = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+    if (timerfd_settime(m_timerFd, TFD_TIMER_ABSTIME, &spec, nullptr)) 
+    {
+        std::cerr << "armTimerFd::timerfd_settime failed: " << strerror(errno) << std::endl;
+        return;
+    }
+    m_timerFdArmed.store(ns, std::memory_order_release);
+}
+
+int64_t IOManager::timerFdDeadline(std::chrono::system_clock::time_point next) 
+{
+    if (next == std::chrono::system_clock::time_point::max()) 
+    {
+        return 0;
+    }
+    // 0 would disarm -> an overdue deadline still fires right away
+    return std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(next.time_since_epoch()).count(), 1);
+}
+
 } // end namespace sylar
\ No newline at end of file
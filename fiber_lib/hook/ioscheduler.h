@@ -4,6 +4,8 @@
 #include "scheduler.h"
 #include "timer.h"
 
+struct epoll_event;
+
 namespace sylar {
 
 // ワークフロー
@@ -17,7 +19,14 @@ public:
         // READ == EPOLLIN
         READ = 0x1,
         // WRITE == EPOLLOUT
-        WRITE = 0x4
+        WRITE = 0x4,
+        // EXCLUSIVE == EPOLLEXCLUSIVE -> 拡張フラグ: 同じfdを複数の epoll インスタンスで待つときに同時起床を防ぐ
+        // 1つの IOManager のワーカーは同じ m_epfd で待ち、もともと1スレッドずつ起こされるので効果はない
+        EXCLUSIVE = 0x10000000,
+        // INLINE -> 拡張フラグ: コールバックをファイバーを作らずにスケジューラファイバー上で実行する
+        // ブロックしない短いコールバック専用 -> 実行時間の上限はない（Scheduler::scheduleInline() を参照）
+        // フックが無効なので、コールバック内で作った fd は自分で FdMgr に登録する
+        INLINE = 0x20000000
     };
 
 private:
@@ -30,7 +39,9 @@ private:
             // コールバック用コルーチン
             std::shared_ptr<Fiber> fiber;
             // コールバック関数
-            std::function<void()> cb;
+            UniqueFunction cb;
+            // cb をスケジューラファイバー上で直接実行する
+            bool inlined = false;
         };
 
         // 読み取り event context
@@ -38,21 +49,26 @@ private:
         // 書き込み event context
         EventContext write;
         int fd = 0;
+        // SO_BUSY_POLL を設定済みか
+        bool busyPoll = false;
         // 登録されたイベント
         Event events = NONE;
+        // 拡張フラグ (EXCLUSIVE)
+        Event flags = NONE;
         std::mutex mutex;
 
         EventContext& getEventContext(Event event);
         void resetEventContext(EventContext &ctx);
-        void triggerEvent(Event event);        
+        // batch != nullptr -> collect the task instead of scheduling it at once
+        void triggerEvent(Event event, std::vector<ScheduleTask>* batch = nullptr);        
     };
 
 public:
     IOManager(size_t threads = 1, bool use_caller = true, const std::string &name = "IOManager");
     ~IOManager();
 
-    // add one event at a time
-    int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+    // add one event at a time -> event may carry extended flags, e.g. READ | EXCLUSIVE, READ | INLINE
+    int addEvent(int fd, Event event, UniqueFunction cb = nullptr);
     // delete event
     bool delEvent(int fd, Event event);
     // delete the event and trigger its callback
@@ -62,6 +78,31 @@ public:
 
     static IOManager* GetThis();
 
+    // busy-poll statistics -> CPU cost and latency of the spin phase
+    struct BusyPollStats 
+    {
+        // time spent spinning in ns
+        uint64_t spinNs = 0;
+        // spins that found work before the budget ran out
+        uint64_t hits = 0;
+        // spins that ran out of budget and fell back to a blocking epoll_wait
+        uint64_t misses = 0;
+        // latency percentiles of the hits in us
+        uint64_t p50Us = 0;
+        uint64_t p90Us = 0;
+        uint64_t p99Us = 0;
+    };
+
+    // spin on epoll_wait(..., 0) for up to max_us before blocking; 0 -> disabled
+    // socket_busy_poll -> also set SO_BUSY_POLL (and SO_PREFER_BUSY_POLL) on sockets added afterwards
+    void setBusyPoll(uint64_t max_us, bool socket_busy_poll = false);
+    BusyPollStats getBusyPollStats() const;
+
+    // drive timers by a timerfd in the epoll set, armed with the earliest deadline at ns precision
+    // -> idle threads block in epoll_wait() without a timeout; timers stay in the shared shard
+    // returns false if the timerfd could not be created
+    bool enableTimerFd();
+
 protected:
     void tickle() override;
     
@@ -69,10 +110,21 @@ protected:
     
     void idle() override;
 
+    void leaveIdle() override;
+
     void onTimerInsertedAtFront() override;
 
     void contextResize(size_t size);
 
+    // spin phase of idle() -> adapts budget_us to how often spinning pays off
+    // stops at next_timer (time_point::max() -> no timer) even if the budget is left
+    int busyPoll(epoll_event *events, int max_events, uint64_t &budget_us, std::chrono::system_clock::time_point next_timer);
+
+    // set the timerfd to the earliest deadline -> locks only when the deadline changed
+    void armTimerFd();
+    // deadline in ns since the epoch for timerfd_settime(), 0 -> no timer
+    static int64_t timerFdDeadline(std::chrono::system_clock::time_point next);
+
 private:
     int m_epfd = 0;
     // ファイルディスクリプタ[0] read，fd[1] write
@@ -81,6 +133,23 @@ private:
     std::shared_mutex m_mutex;
     // 各ファイルディスクリプタのコンテキストを保存
     std::vector<FdContext *> m_fdContexts;
+
+    // busy-poll budget upper bound in us
+    std::atomic<uint64_t> m_busyPollMaxUs = {0};
+    std::atomic<bool> m_socketBusyPoll = {false};
+    std::atomic<uint64_t> m_busyPollNs = {0};
+    std::atomic<uint64_t> m_busyPollHits = {0};
+    std::atomic<uint64_t> m_busyPollMisses = {0};
+    // log2 histogram of the hit latency in us
+    std::atomic<uint64_t> m_busyPollLatency[32] = {};
+
+    // -1 -> timers are driven by epoll_wait timeouts
+    std::atomic<int> m_timerFd = {-1};
+    // serializes arming so a later deadline never overwrites an earlier one
+    std::mutex m_timerFdMutex;
+    // deadline the timerfd is armed with in ns since the epoch, 0 -> disarmed
+    // written under m_timerFdMutex, read without it by the fast path of armTimerFd()
+    std::atomic<int64_t> m_timerFdArmed = {0};
 };
 
 } // end namespace sylar
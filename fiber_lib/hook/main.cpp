@@ -1,5 +1,6 @@
 #include "ioscheduler.h"
 #include "hook.h"
+#include "fd_manager.h"
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -23,7 +24,7 @@ void error(const char *msg)
 
 void watch_io_read()
 {
-    sylar::IOManager::GetThis()->addEvent(sock_listen_fd, sylar::IOManager::READ, test_accept);
+    sylar::IOManager::GetThis()->addEvent(sock_listen_fd, (sylar::IOManager::Event)(sylar::IOManager::READ | sylar::IOManager::INLINE), test_accept);
 }
 
 void test_accept()
@@ -39,6 +40,8 @@ void test_accept()
     else
     {
         std::cout << "accepted connection, fd = " << fd << std::endl;
+        // inline callbacks run unhooked -> accept() didn't register the fd, do what the hooked accept() does
+        sylar::FdMgr::GetInstance()->get(fd, true);
         fcntl(fd, F_SETFL, O_NONBLOCK);
         sylar::IOManager::GetThis()->addEvent(fd, sylar::IOManager::READ, [fd]()
         {
@@ -85,7 +88,8 @@ void test_accept()
             }
         });
     }
-    sylar::IOManager::GetThis()->addEvent(sock_listen_fd, sylar::IOManager::READ, test_accept);
+    // accept on the non-blocking listen fd never waits -> INLINE runs it without creating a fiber
+    sylar::IOManager::GetThis()->addEvent(sock_listen_fd, (sylar::IOManager::Event)(sylar::IOManager::READ | sylar::IOManager::INLINE), test_accept);
 }
 
 void test_iomanager()
@@ -122,7 +126,7 @@ void test_iomanager()
     printf("epoll echo server listening for connections on port: %d\n", portno);
     fcntl(sock_listen_fd, F_SETFL, O_NONBLOCK);
     sylar::IOManager iom(9);
-    iom.addEvent(sock_listen_fd, sylar::IOManager::READ, test_accept);
+    iom.addEvent(sock_listen_fd, (sylar::IOManager::Event)(sylar::IOManager::READ | sylar::IOManager::INLINE), test_accept);
 }
 
 int main(int argc, char *argv[])
@@ -0,0 +1,177 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include "scheduler.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+namespace sylar {
+
+// 範囲を再帰的に分割してスケジューラのワーカーで並列に実行するジョブ
+// 分割した後半はタスクとして共有キューに入り、空いているワーカーが取り出して実行する（さらに分割する）
+// 呼び出し元のファイバーは前半を実行し、残りが終わるまで実行権を譲って待つ
+// 共有スタックのファイバーから呼ばれても参照が無効にならないように、ジョブはヒープに置く
+template <class Leaf>
+class ParallelJob
+{
+public:
+	template <class... Args>
+	ParallelJob(Scheduler* scheduler, Args&&... args):
+	m_scheduler(scheduler), m_waiter(Fiber::GetThis()), m_leaf(std::forward<Args>(args)...)
+	{
+	}
+
+	// [begin, end) を grain 以下になるまで半分に分けながら実行する
+	template <class Index>
+	void split(Index begin, Index end, Index grain)
+	{
+		while(end - begin > grain)
+		{
+			Index mid = begin + (end - begin) / 2;
+			m_pending.fetch_add(1, std::memory_order_relaxed);
+			m_scheduler->scheduleLock([this, mid, end, grain]()
+			{
+				split(mid, end, grain);
+				done();
+			});
+			end = mid;
+		}
+		m_leaf(begin, end);
+	}
+
+	// 呼び出し元の分担が終わった -> 残りがあれば最後に終わったタスクに起こされるまで待つ
+	void wait()
+	{
+		if(m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			return;
+		}
+		Fiber::GetThisRaw()->yield();
+	}
+
+	Leaf& leaf() {return m_leaf;}
+
+private:
+	void done()
+	{
+		if(m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			// 呼び出し元は待機中 -> ここから先はジョブを参照しない
+			std::shared_ptr<Fiber> waiter = std::move(m_waiter);
+			m_scheduler->scheduleLock(std::move(waiter));
+		}
+	}
+
+private:
+	Scheduler* m_scheduler;
+	std::shared_ptr<Fiber> m_waiter;
+	// 未完了の分担数 -> 呼び出し元の分を含む
+	std::atomic<size_t> m_pending{1};
+	Leaf m_leaf;
+};
+
+template <class Index, class Fn>
+struct ParallelForLeaf
+{
+	Fn fn;
+
+	explicit ParallelForLeaf(Fn f): fn(std::move(f)) {}
+
+	void operator()(Index begin, Index end)
+	{
+		for(Index i = begin; i < end; ++i)
+		{
+			fn(i);
+		}
+	}
+};
+
+template <class Index, class T, class Map, class Combine>
+struct ParallelReduceLeaf
+{
+	T identity;
+	Map map;
+	Combine combine;
+	std::mutex mutex;
+	T result;
+
+	ParallelReduceLeaf(T init, Map m, Combine c): identity(init), map(std::move(m)), combine(std::move(c)), result(std::move(init)) {}
+
+	// 分担の範囲はロックなしで集計し、最後に1回だけ結果に合成する
+	void operator()(Index begin, Index end)
+	{
+		T acc = identity;
+		for(Index i = begin; i < end; ++i)
+		{
+			acc = combine(std::move(acc), map(i));
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		result = combine(std::move(result), std::move(acc));
+	}
+};
+
+// 呼び出し元がスケジューラのタスクとして実行されている -> 並列化できる
+inline Scheduler* ParallelScheduler()
+{
+	Scheduler* scheduler = Scheduler::GetThis();
+	if(!scheduler || !Fiber::GetThisRaw()->isRunInScheduler())
+	{
+		return nullptr;
+	}
+	return scheduler;
+}
+
+// [begin, end) の各 i について fn(i) を並列に実行する -> すべて終わってから戻る
+// grain -> これ以下の範囲は分割せずに1つのタスクで実行する
+// スケジューラの外から呼ばれた場合は呼び出し元で順に実行する
+template <class Index, class Fn>
+void parallel_for(Index begin, Index end, Index grain, Fn fn)
+{
+	if(grain < 1)
+	{
+		grain = 1;
+	}
+
+	Scheduler* scheduler = ParallelScheduler();
+	if(!scheduler || end - begin <= grain)
+	{
+		ParallelForLeaf<Index, Fn> leaf(std::move(fn));
+		leaf(begin, end);
+		return;
+	}
+
+	std::unique_ptr<ParallelJob<ParallelForLeaf<Index, Fn>>> job(new ParallelJob<ParallelForLeaf<Index, Fn>>(scheduler, std::move(fn)));
+	job->split(begin, end, grain);
+	job->wait();
+}
+
+// [begin, end) の map(i) を combine で畳み込む -> identity は combine の単位元
+// 分担ごとの部分結果を完了順に合成するので、combine は結合的かつ可換であること
+template <class Index, class T, class Map, class Combine>
+T parallel_reduce(Index begin, Index end, Index grain, T identity, Map map, Combine combine)
+{
+	typedef ParallelReduceLeaf<Index, T, Map, Combine> Leaf;
+	if(grain < 1)
+	{
+		grain = 1;
+	}
+
+	Scheduler* scheduler = ParallelScheduler();
+	if(!scheduler || end - begin <= grain)
+	{
+		Leaf leaf(std::move(identity), std::move(map), std::move(combine));
+		leaf(begin, end);
+		return std::move(leaf.result);
+	}
+
+	std::unique_ptr<ParallelJob<Leaf>> job(new ParallelJob<Leaf>(scheduler, std::move(identity), std::move(map), std::move(combine)));
+	job->split(begin, end, grain);
+	job->wait();
+	return std::move(job->leaf().result);
+}
+
+}
+
+#endif
@@ -1,11 +1,42 @@
 #include "scheduler.h"
 
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <sched.h>
+#include <pthread.h>
+
 static bool debug = false;
 
 namespace sylar {
 
 static thread_local Scheduler* t_scheduler = nullptr;
 
+// このスレッドが最後にタスクを実行した時刻 -> 退役の判断に使う
+static thread_local std::chrono::steady_clock::time_point t_lastBusy;
+
+struct Scheduler::WorkerSlot
+{
+	// 実行中のファイバーID
+	std::atomic<uint64_t> fiberId = {(uint64_t)-1};
+	// 実行開始時刻（steady_clock ns） 0 -> 実行中のファイバーなし
+	std::atomic<int64_t> startNs = {0};
+	// タイムスライス超過 -> 次のセーフポイントで実行権を譲る
+	std::atomic<bool> preempt = {false};
+	int thread = -1;
+	// このスロットを持つスケジューラ -> 別のスケジューラの runnext に入れない
+	Scheduler* owner = nullptr;
+	// アイドルループから直接渡されたタスク -> run() がキューを経由せずに次に実行する
+	ScheduleTask runNext;
+};
+
+thread_local Scheduler::WorkerSlot* Scheduler::t_slot = nullptr;
+
+static int64_t NowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 Scheduler* Scheduler::GetThis()
 {
 	return t_scheduler;
@@ -16,6 +47,98 @@ void Scheduler::SetThis()
 	t_scheduler = this;
 }
 
+bool Scheduler::YieldIfPreempted()
+{
+	Scheduler* sc = GetThis();
+	if(!sc || !t_slot || !t_slot->preempt.load(std::memory_order_relaxed))
+	{
+		return false;
+	}
+
+	// タスクのファイバー以外（スケジューラ・アイドルファイバー）は譲らない
+	Fiber* curr = Fiber::GetThisRaw();
+	if(curr->getId() != t_slot->fiberId)
+	{
+		return false;
+	}
+
+	t_slot->preempt = false;
+	sc->scheduleLock(curr->shared_from_this());
+	curr->yield();
+	return true;
+}
+
+// "0-3,8-11" 形式のCPUリストを解析する
+static std::vector<int> ParseCpuList(const std::string& str)
+{
+	std::vector<int> cpus;
+	std::stringstream ss(str);
+	std::string item;
+	while(std::getline(ss, item, ','))
+	{
+		if(item.empty())
+		{
+			continue;
+		}
+		size_t dash = item.find('-');
+		int first = std::stoi(item.substr(0, dash));
+		int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+		for(int cpu = first; cpu <= last; cpu++)
+		{
+			cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+// NUMAノードごとのCPU一覧 -> プロセスが使えるCPUのみ
+static std::vector<std::vector<int>> GetNumaNodes()
+{
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+
+	std::vector<std::vector<int>> nodes;
+	for(int node = 0; ; node++)
+	{
+		std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+		if(!in)
+		{
+			break;
+		}
+		std::string line;
+		std::getline(in, line);
+
+		std::vector<int> cpus;
+		for(int cpu : ParseCpuList(line))
+		{
+			if(CPU_ISSET(cpu, &allowed))
+			{
+				cpus.push_back(cpu);
+			}
+		}
+		if(!cpus.empty())
+		{
+			nodes.push_back(cpus);
+		}
+	}
+
+	// NUMA情報がない -> 1ノードとして扱う
+	if(nodes.empty())
+	{
+		std::vector<int> cpus;
+		for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		{
+			if(CPU_ISSET(cpu, &allowed))
+			{
+				cpus.push_back(cpu);
+			}
+		}
+		nodes.push_back(cpus);
+	}
+	return nodes;
+}
+
 Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name):
 m_useCaller(use_caller), m_name(name)
 {
@@ -68,9 +191,10 @@ void Scheduler::start()
 	m_threads.resize(m_threadCount);
 	for(size_t i=0;i<m_threadCount;i++)
 	{
-		m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this), m_name + "_" + std::to_string(i)));
+		m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this), m_name + "_" + std::to_string(i), cpuForWorker(m_useCaller ? i + 1 : i)));
 		m_threadIds.push_back(m_threads[i]->getId());
 	}
+	m_liveThreadCount = m_threadCount;
 	if(debug) std::cout << "Scheduler::start() success\n";
 }
 
@@ -91,33 +215,122 @@ void Scheduler::run()
 
 	std::shared_ptr<Fiber> idle_fiber = std::make_shared<Fiber>(std::bind(&Scheduler::idle, this));
 	ScheduleTask task;
+	bool from_idle = false;
+	t_lastBusy = std::chrono::steady_clock::now();
+
+	std::shared_ptr<WorkerSlot> slot = std::make_shared<WorkerSlot>();
+	slot->thread = thread_id;
+	slot->owner = this;
+	t_slot = slot.get();
+	{
+		std::lock_guard<std::mutex> lock(m_slotMutex);
+		m_slots.push_back(slot);
+	}
 	
 	while(true)
 	{
 		task.reset();
 		bool tickle_me = false;
 
+		// 0 アイドルループから渡されたタスクを優先 -> ロックもキューも経由しない
+		if(slot->runNext.fiber || slot->runNext.cb)
+		{
+			std::swap(task, slot->runNext);
+		}
+		else
 		{
 			std::lock_guard<std::mutex> lock(m_mutex);
-			auto it = m_tasks.begin();
-			// 1 タスクキューを巡回する
-			while(it!=m_tasks.end())
+
+			// 期限付きタスク -> 期限の最も早いものから
+			if(!m_deadlineTasks.empty())
 			{
-				if(it->thread!=-1&&it->thread!=thread_id)
+				auto now = std::chrono::steady_clock::now();
+				DeadlinePolicy policy = m_deadlinePolicy;
+				while(!m_deadlineTasks.empty())
 				{
-					it++;
-					tickle_me = true;
-					continue;
+					std::pop_heap(m_deadlineTasks.begin(), m_deadlineTasks.end(), &ScheduleTask::LaterDeadline);
+					task = std::move(m_deadlineTasks.back());
+					m_deadlineTasks.pop_back();
+					m_taskCount--;
+
+					// 他のスレッドに固定されている -> そのスレッドに通常のタスクとして回す
+					if(task.thread != -1 && task.thread != thread_id)
+					{
+						m_tasks[task.priority].push_back(std::move(task));
+						m_taskCount++;
+						tickle_me = true;
+						task.reset();
+						continue;
+					}
+
+					if(task.deadline < now)
+					{
+						m_deadlineMissCount++;
+						if(policy == DEADLINE_CANCEL && task.cb)
+						{
+							task.reset();
+							continue;
+						}
+						if(policy != DEADLINE_RUN)
+						{
+							// 間に合わない -> 他のタスクにCPUを譲る
+							task.deadline = std::chrono::steady_clock::time_point();
+							task.priority = PRIORITY_LOW;
+							m_tasks[PRIORITY_LOW].push_back(std::move(task));
+							m_taskCount++;
+							task.reset();
+							continue;
+						}
+						// そのまま実行する -> 期限は外す（以後キューに戻るときに何度も取りこぼしとして数えない）
+						task.deadline = std::chrono::steady_clock::time_point();
+					}
+					m_activeThreadCount++;
+					break;
 				}
+			}
 
-				// 2 タスクを取り出す
-				assert(it->fiber||it->cb);
-				task = *it;
-				m_tasks.erase(it); 
-				m_activeThreadCount++;
-				break;
-			}	
-			tickle_me = tickle_me || (it != m_tasks.end());
+			// strict -> 常に高優先度から / weighted -> 現在のクラスから
+			int first = m_dequeuePolicy == DEQUEUE_STRICT ? (int)PRIORITY_HIGH : m_wrrClass;
+			for(int i = 0; i < PRIORITY_COUNT && !(task.fiber || task.cb); i++)
+			{
+				int cls = (first + i) % PRIORITY_COUNT;
+				std::vector<ScheduleTask>& tasks = m_tasks[cls];
+				auto it = tasks.begin();
+				// 1 タスクキューを巡回する
+				while(it!=tasks.end())
+				{
+					if(it->thread!=-1&&it->thread!=thread_id)
+					{
+						it++;
+						tickle_me = true;
+						continue;
+					}
+
+					// 2 タスクを取り出す
+					assert(it->fiber||it->cb);
+					task = std::move(*it);
+					tasks.erase(it); 
+					m_taskCount--;
+					m_activeThreadCount++;
+					break;
+				}
+
+				// weighted -> このクラスの取り出し数を使い切ったら次のクラスへ
+				if(m_dequeuePolicy == DEQUEUE_WEIGHTED && (task.fiber || task.cb))
+				{
+					if(cls != m_wrrClass)
+					{
+						m_wrrClass = cls;
+						m_wrrCredit = m_weights[cls];
+					}
+					if(--m_wrrCredit <= 0)
+					{
+						m_wrrClass = (cls + 1) % PRIORITY_COUNT;
+						m_wrrCredit = m_weights[m_wrrClass];
+					}
+				}
+			}
+			tickle_me = tickle_me || m_taskCount > 0;
 		}
 
 		if(tickle_me)
@@ -125,26 +338,58 @@ void Scheduler::run()
 			tickle();
 		}
 
+		// キュー待ちが長すぎる -> スレッドが足りない
+		if(task.enqueued != std::chrono::steady_clock::time_point() &&
+			std::chrono::steady_clock::now() - task.enqueued > std::chrono::microseconds(m_growLatencyUs))
+		{
+			addThread();
+		}
+
+		// アイドルから実行中に変わった
+		if(from_idle && (task.fiber || task.cb))
+		{
+			from_idle = false;
+			leaveIdle();
+		}
+
 		// 3 タスクを実行する
 		if(task.fiber)
 		{
-			{					
-				std::lock_guard<std::mutex> lock(task.fiber->m_mutex);
-				if(task.fiber->getState()!=Fiber::TERM)
-				{
-					task.fiber->resume();	
-				}
-			}
+			// 別のスレッドで切り替え中なら resume() が完了を待つ 終了済みなら何もしない
+			// 実行したクラスと期限を覚える -> 待機・yield から戻るときに同じキューに入る
+			task.fiber->setPriority(task.priority);
+			task.fiber->setDeadline(task.deadline);
+			beginSlice(task.fiber->getId());
+			task.fiber->resume();	
+			endSlice();
+			m_activeThreadCount--;
+			task.reset();
+		}
+		else if(task.cb && task.inlined)
+		{
+			// インライン -> ファイバーを作らずにこのスケジューラファイバー上で実行する
+			// フックを無効にする -> 誤ってブロックしてもスケジューラファイバーが yield しない
+			set_hook_enable(false);
+			task.cb();
+			set_hook_enable(true);
 			m_activeThreadCount--;
 			task.reset();
 		}
 		else if(task.cb)
 		{
-			std::shared_ptr<Fiber> cb_fiber = std::make_shared<Fiber>(task.cb);
+			// 自動サイズが有効 -> 呼び出し元ごとに学習したサイズクラスで作成
+			size_t stacksize = Fiber::IsStackAutoSize() ? Fiber::GetRecommendedStackSize(task.cb) : 0;
+			std::shared_ptr<Fiber> cb_fiber = std::make_shared<Fiber>(std::move(task.cb), stacksize);
+			// 引き継いだキャンセルトークン -> ファイバーの終了時に解除される
+			if(task.token)
 			{
-				std::lock_guard<std::mutex> lock(cb_fiber->m_mutex);
-				cb_fiber->resume();			
+				CancellationToken::SetFor(cb_fiber.get(), std::move(task.token));
 			}
+			cb_fiber->setPriority(task.priority);
+			cb_fiber->setDeadline(task.deadline);
+			beginSlice(cb_fiber->getId());
+			cb_fiber->resume();			
+			endSlice();
 			m_activeThreadCount--;
 			task.reset();	
 		}
@@ -160,8 +405,17 @@ void Scheduler::run()
 			m_idleThreadCount++;
 			idle_fiber->resume();				
 			m_idleThreadCount--;
+			from_idle = true;
+			continue;
 		}
+		t_lastBusy = std::chrono::steady_clock::now();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_slotMutex);
+		m_slots.erase(std::find(m_slots.begin(), m_slots.end(), slot));
 	}
+	t_slot = nullptr;
 	
 }
 
@@ -185,7 +439,7 @@ void Scheduler::stop()
         assert(GetThis() != this);
     }
 	
-	for (size_t i = 0; i < m_threadCount; i++) 
+	for (size_t i = 0; i < m_liveThreadCount; i++) 
 	{
 		tickle();
 	}
@@ -207,6 +461,13 @@ void Scheduler::stop()
 		thrs.swap(m_threads);
 	}
 
+	if(m_monitorThread)
+	{
+		m_monitorStop = true;
+		thrs.push_back(m_monitorThread);
+		m_monitorThread.reset();
+	}
+
 	for(auto &i : thrs)
 	{
 		i->join();
@@ -214,24 +475,369 @@ void Scheduler::stop()
 	if(debug) std::cout << "Schedule::stop() ends in thread:" << Thread::GetThreadId() << std::endl;
 }
 
+void Scheduler::scheduleTasks(std::vector<ScheduleTask>& tasks)
+{
+	int thread_id = Thread::GetThreadId();
+	auto it = tasks.begin();
+
+	// 1 このスレッドで実行できる最初のタスク -> runnext へ
+	// このスケジューラの run() 内でなければ runnext は使わない -> すべてキューへ
+	WorkerSlot* slot = (t_slot && t_slot->owner == this) ? t_slot : nullptr;
+	if(slot && !slot->runNext.fiber && !slot->runNext.cb)
+	{
+		for(; it != tasks.end(); it++)
+		{
+			if((it->fiber || it->cb) && (it->thread == -1 || it->thread == thread_id))
+			{
+				std::swap(slot->runNext, *it);
+				// キューから取り出したタスクと同様に実行中として数える -> stopping() が先に真にならない
+				m_activeThreadCount++;
+				break;
+			}
+		}
+	}
+
+	// 2 残りを1回のロックで投入
+	size_t n = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_enqueueLockCount.fetch_add(1, std::memory_order_relaxed);
+		for(auto& task : tasks)
+		{
+			if(task.fiber || task.cb)
+			{
+				if(m_maxThreadCount)
+				{
+					task.enqueued = std::chrono::steady_clock::now();
+				}
+				enqueue(std::move(task));
+				n++;
+			}
+		}
+		m_taskCount += n;
+		m_enqueuedTaskCount.fetch_add(n, std::memory_order_relaxed);
+	}
+	tasks.clear();
+
+	if(n == 0)
+	{
+		return;
+	}
+
+	// 3 このスレッドは runnext を実行する -> キューに入れたタスク数だけ他のアイドルスレッドを起こす
+	size_t idle = m_idleThreadCount;
+	size_t wake = std::min(n, idle > 0 ? idle - 1 : 0);
+	for(size_t i = 0; i < wake; i++)
+	{
+		tickle();
+	}
+}
+
+void Scheduler::enqueue(ScheduleTask&& task)
+{
+	if(task.deadline != std::chrono::steady_clock::time_point())
+	{
+		m_deadlineTasks.push_back(std::move(task));
+		std::push_heap(m_deadlineTasks.begin(), m_deadlineTasks.end(), &ScheduleTask::LaterDeadline);
+	}
+	else
+	{
+		m_tasks[task.priority].push_back(std::move(task));
+	}
+}
+
+void Scheduler::setDequeuePolicy(DequeuePolicy policy, const std::vector<int>& weights)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_dequeuePolicy = policy;
+	for(size_t i = 0; i < PRIORITY_COUNT && i < weights.size(); i++)
+	{
+		m_weights[i] = std::max(weights[i], 1);
+	}
+	m_wrrClass = PRIORITY_HIGH;
+	m_wrrCredit = m_weights[PRIORITY_HIGH];
+}
+
+void Scheduler::setPreemption(uint64_t slice_ms)
+{
+	m_preemptSliceMs = slice_ms;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if(slice_ms && !m_monitorThread && !m_stopping)
+	{
+		m_monitorThread.reset(new Thread(std::bind(&Scheduler::monitor, this), m_name + "_monitor"));
+	}
+}
+
+void Scheduler::beginSlice(uint64_t fiber_id)
+{
+	if(m_preemptSliceMs)
+	{
+		t_slot->fiberId = fiber_id;
+		t_slot->preempt = false;
+		t_slot->startNs = NowNs();
+	}
+}
+
+void Scheduler::endSlice()
+{
+	t_slot->startNs = 0;
+}
+
+void Scheduler::monitor()
+{
+	while(!m_monitorStop)
+	{
+		uint64_t slice_ms = m_preemptSliceMs;
+		// フックは無効 -> 元の usleep
+		usleep(std::max<uint64_t>(slice_ms, 2) * 1000 / 2);
+		if(!slice_ms)
+		{
+			continue;
+		}
+
+		int64_t now = NowNs();
+		std::lock_guard<std::mutex> lock(m_slotMutex);
+		for(auto& slot : m_slots)
+		{
+			int64_t start = slot->startNs;
+			if(start == 0 || now - start < (int64_t)slice_ms * 1000000)
+			{
+				continue;
+			}
+			// 1回の実行につき1度だけ報告する
+			if(!slot->preempt.exchange(true))
+			{
+				m_preemptCount++;
+				std::cerr << "Scheduler: fiber " << slot->fiberId << " has been running for " << (now - start) / 1000000 
+					<< " ms without yielding in thread " << slot->thread << std::endl;
+			}
+		}
+	}
+}
+
+void Scheduler::setAffinity(AffinityPolicy policy, const std::vector<int>& cpus)
+{
+	std::vector<int> order;
+	if(policy == AFFINITY_LIST)
+	{
+		order = cpus;
+	}
+	else if(policy != AFFINITY_NONE)
+	{
+		std::vector<std::vector<int>> nodes = GetNumaNodes();
+		if(policy == AFFINITY_COMPACT)
+		{
+			// ノード0を埋めてからノード1へ
+			for(auto& node : nodes)
+			{
+				order.insert(order.end(), node.begin(), node.end());
+			}
+		}
+		else
+		{
+			// 各ノードから1つずつ交互に
+			for(size_t i = 0; order.size() < CPU_SETSIZE; i++)
+			{
+				bool added = false;
+				for(auto& node : nodes)
+				{
+					if(i < node.size())
+					{
+						order.push_back(node[i]);
+						added = true;
+					}
+				}
+				if(!added)
+				{
+					break;
+				}
+			}
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_cpus.swap(order);
+	if(m_cpus.empty())
+	{
+		return;
+	}
+
+	// 実行中のスレッドにも適用する
+	size_t index = 0;
+	if(m_useCaller)
+	{
+		if(Thread::GetThreadId() == m_rootThread)
+		{
+			cpu_set_t cpuset;
+			CPU_ZERO(&cpuset);
+			CPU_SET(cpuForWorker(0), &cpuset);
+			pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+		}
+		index++;
+	}
+	for(auto& thr : m_threads)
+	{
+		// 退役済みのスレッドは除く
+		if(std::find(m_retiredThreadIds.begin(), m_retiredThreadIds.end(), thr->getId()) == m_retiredThreadIds.end())
+		{
+			thr->setAffinity(cpuForWorker(index++));
+		}
+	}
+}
+
+int Scheduler::cpuForWorker(size_t i) const
+{
+	if(m_cpus.empty())
+	{
+		return -1;
+	}
+	return m_cpus[i % m_cpus.size()];
+}
+
+void Scheduler::setDynamicThreads(size_t max_threads, uint64_t latency_us, uint64_t keepalive_ms)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	// 0 -> 無効（追加済みのスレッドは退役しない）
+	if(max_threads == 0)
+	{
+		m_maxThreadCount = 0;
+		return;
+	}
+	// コンストラクタと同様に max_threads はメインスレッドを含む
+	size_t max_workers = m_useCaller ? max_threads - 1 : max_threads;
+	m_maxThreadCount = std::max(max_workers, m_threadCount);
+	m_growLatencyUs = latency_us;
+	m_keepAliveMs = keepalive_ms;
+}
+
+void Scheduler::addThread()
+{
+	auto now = std::chrono::steady_clock::now();
+
+	// 退役済みのスレッド -> ロックを外してから join する
+	std::vector<std::shared_ptr<Thread>> retired;
+	{
+		// 呼び出しスレッドだけのスケジューラは stop() の中でしか run() しない -> m_stopping で増やさない
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if(m_stopping || m_liveThreadCount >= m_maxThreadCount || now - m_lastGrow < std::chrono::microseconds(m_growLatencyUs))
+		{
+			return;
+		}
+		m_lastGrow = now;
+
+		for(int id : m_retiredThreadIds)
+		{
+			for(auto it = m_threads.begin(); it != m_threads.end(); it++)
+			{
+				if((*it)->getId() == id)
+				{
+					retired.push_back(*it);
+					m_threads.erase(it);
+					break;
+				}
+			}
+		}
+		m_retiredThreadIds.clear();
+
+		// 新しいスレッドは m_mutex を取る前にセマフォで通知する -> ロック中に作成しても問題ない
+		size_t index = m_liveThreadCount + (m_useCaller ? 1 : 0);
+		std::shared_ptr<Thread> thr(new Thread(std::bind(&Scheduler::run, this), m_name + "_" + std::to_string(m_growCount + m_threadCount), cpuForWorker(index)));
+		m_threads.push_back(thr);
+		m_threadIds.push_back(thr->getId());
+		m_liveThreadCount++;
+		m_growCount++;
+		if(debug) std::cout << "Scheduler::addThread(), threads = " << m_liveThreadCount << std::endl;
+	}
+
+	// join は終了を待つ -> m_mutex を持ったまま待つと他のワーカーが全員止まる
+	for(auto& thr : retired)
+	{
+		thr->join();
+	}
+}
+
+bool Scheduler::retiring()
+{
+	if(!m_maxThreadCount || Thread::GetThreadId() == m_rootThread)
+	{
+		return false;
+	}
+	if(std::chrono::steady_clock::now() - t_lastBusy < std::chrono::milliseconds(m_keepAliveMs))
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if(m_stopping || m_liveThreadCount <= m_threadCount)
+	{
+		return false;
+	}
+	// このスレッドに固定された処理が残っている -> 退役すると実行されない
+	if(Fiber::GetPinnedCount() > 0 || hasPinnedTask(Thread::GetThreadId()))
+	{
+		return false;
+	}
+	m_liveThreadCount--;
+	m_retireCount++;
+	m_retiredThreadIds.push_back(Thread::GetThreadId());
+	if(debug) std::cout << "Scheduler::retiring(), threads = " << m_liveThreadCount << std::endl;
+	return true;
+}
+
+bool Scheduler::hasPinnedTask(int thread)
+{
+	for(int i = 0; i < PRIORITY_COUNT; i++)
+	{
+		for(auto& task : m_tasks[i])
+		{
+			if(task.thread == thread)
+			{
+				return true;
+			}
+		}
+	}
+	for(auto& task : m_deadlineTasks)
+	{
+		if(task.thread == thread)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+uint64_t Scheduler::retireWaitMs()
+{
+	// 候補かどうかはロックなしで見る -> 外れても retiring() が判断し直す
+	// 固定されたファイバーが残っている -> そのファイバーの再開で起こされるので待つ必要はない
+	if(!m_maxThreadCount || Thread::GetThreadId() == m_rootThread || m_liveThreadCount <= m_threadCount || Fiber::GetPinnedCount() > 0)
+	{
+		return UINT64_MAX;
+	}
+	uint64_t idle_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t_lastBusy).count();
+	// 期限を過ぎても退役できなかった -> 空回りしないように少し待つ
+	return idle_ms < m_keepAliveMs ? m_keepAliveMs - idle_ms : 1;
+}
+
 void Scheduler::tickle()
 {
 }
 
 void Scheduler::idle()
 {
-	while(!stopping())
+	while(!stopping() && !retiring())
 	{
 		if(debug) std::cout << "Scheduler::idle(), sleeping in thread: " << Thread::GetThreadId() << std::endl;	
 		sleep(1);	
-		Fiber::GetThis()->yield();
+		Fiber::GetThisRaw()->yield();
 	}
 }
 
 bool Scheduler::stopping() 
 {
     std::lock_guard<std::mutex> lock(m_mutex);
-    return m_stopping && m_tasks.empty() && m_activeThreadCount == 0;
+    return m_stopping && m_taskCount == 0 && m_activeThreadCount == 0;
 }
 
 
@@ -4,14 +4,60 @@
 #include "hook.h"
 #include "fiber.h"
 #include "thread.h"
+#include "cancellation.h"
 
 #include <mutex>
 #include <vector>
+#include <chrono>
+#include <algorithm>
 
 namespace sylar {
 
 class Scheduler
 {
+public:
+	// ワーカースレッドのCPU配置ポリシー
+	enum AffinityPolicy
+	{
+		// 固定しない
+		AFFINITY_NONE,
+		// NUMAノードを順に埋める
+		AFFINITY_COMPACT,
+		// NUMAノード間に交互に分散する
+		AFFINITY_SCATTER,
+		// 指定したCPUリストを順に使う
+		AFFINITY_LIST
+	};
+
+	// タスクの優先度クラス -> 値が小さいほど優先
+	enum Priority
+	{
+		PRIORITY_HIGH = 0,
+		PRIORITY_NORMAL,
+		PRIORITY_LOW,
+		PRIORITY_COUNT
+	};
+
+	// 優先度クラス間の取り出し方
+	enum DequeuePolicy
+	{
+		// 常に最も高い優先度から
+		DEQUEUE_STRICT,
+		// 重みに比例して各クラスから順に
+		DEQUEUE_WEIGHTED
+	};
+
+	// 期限を過ぎた期限付きタスクの扱い
+	enum DeadlinePolicy
+	{
+		// そのまま実行する
+		DEADLINE_RUN,
+		// 低優先度キューに回す
+		DEADLINE_DEPRIORITIZE,
+		// コールバックは破棄する（ファイバーは再開しないと残るため低優先度キューに回す）
+		DEADLINE_CANCEL
+	};
+
 public:
 	Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name="Scheduler");
 	virtual ~Scheduler();
@@ -22,25 +68,42 @@ public:
 	// 実行中のスケジューラを取得
 	static Scheduler* GetThis();
 
+	// セーフポイント -> タイムスライスを使い切ったファイバーなら実行権を譲る（キューの末尾に戻る）
+	static bool YieldIfPreempted();
+
 protected:
 	// 実行中のスケジューラを設定
 	void SetThis();
 	
 public:	
-	// タスクをタスクリストに追加
+	// タスクをタスクリストに追加 -> コールバックは UniqueFunction にムーブされ、以後コピーされない
+	// 実行済みのファイバーを PRIORITY_NORMAL（デフォルト）で追加 -> 前回実行されたクラスを引き継ぐ
+	// 期限付きで実行されたファイバーは期限付きタスクとして戻る
     template <class FiberOrCb>
-    void scheduleLock(FiberOrCb fc, int thread = -1) 
+    void scheduleLock(FiberOrCb&& fc, int thread = -1, Priority priority = PRIORITY_NORMAL) 
     {
     	bool need_tickle;
+    	// キャンセルトークンの子の作成はロックの外で行う
+    	ScheduleTask task(std::forward<FiberOrCb>(fc), thread);
     	{
     		std::lock_guard<std::mutex> lock(m_mutex);
+    		m_enqueueLockCount.fetch_add(1, std::memory_order_relaxed);
     		// empty ->  all thread is idle -> need to be waken up
-    		need_tickle = m_tasks.empty();
+    		need_tickle = m_taskCount == 0;
 	        
-	        ScheduleTask task(fc, thread);
 	        if (task.fiber || task.cb) 
 	        {
-	            m_tasks.push_back(task);
+	        	if(m_maxThreadCount)
+	        	{
+	        		task.enqueued = std::chrono::steady_clock::now();
+	        	}
+	        	if(!task.fiber || priority != PRIORITY_NORMAL)
+	        	{
+	        		task.priority = priority;
+	        	}
+	            enqueue(std::move(task));
+	            m_taskCount++;
+	            m_enqueuedTaskCount.fetch_add(1, std::memory_order_relaxed);
 	        }
     	}
     	
@@ -50,10 +113,171 @@ public:
     	}
     }
 	
+
+	// 複数のタスクを1回のロックでまとめて追加 -> アイドルスレッドを min(n, idle) だけ起こす
+	// 要素はコピーされる（UniqueFunction など移動のみの要素は std::make_move_iterator で渡す）
+	template <class Iterator>
+	void scheduleBatch(Iterator begin, Iterator end, int thread = -1, Priority priority = PRIORITY_NORMAL)
+	{
+		// キャンセルトークンの子の作成はロックの外で行う
+		std::vector<ScheduleTask> tasks;
+		for(; begin != end; ++begin)
+		{
+			ScheduleTask task(*begin, thread);
+			if (task.fiber || task.cb)
+			{
+				if(!task.fiber || priority != PRIORITY_NORMAL)
+				{
+					task.priority = priority;
+				}
+				tasks.push_back(std::move(task));
+			}
+		}
+
+		size_t n = tasks.size();
+		bool need_tickle;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_enqueueLockCount.fetch_add(1, std::memory_order_relaxed);
+			need_tickle = m_taskCount == 0;
+
+			std::chrono::steady_clock::time_point now;
+			if(m_maxThreadCount)
+			{
+				now = std::chrono::steady_clock::now();
+			}
+			for(auto& task : tasks)
+			{
+				task.enqueued = now;
+				enqueue(std::move(task));
+			}
+			m_taskCount += n;
+			m_enqueuedTaskCount.fetch_add(n, std::memory_order_relaxed);
+		}
+
+		// アイドルスレッドがなく全員実行中 -> 次の取り出しで拾われる
+		size_t wake = std::min(n, (size_t)m_idleThreadCount);
+		if(wake == 0 && need_tickle && n > 0)
+		{
+			wake = 1;
+		}
+		for(size_t i = 0; i < wake; i++)
+		{
+			tickle();
+		}
+	}
+
+	// 要素をムーブして追加する
+	template <class FiberOrCb>
+	void scheduleBatch(std::vector<FiberOrCb>&& fcs, int thread = -1, Priority priority = PRIORITY_NORMAL)
+	{
+		scheduleBatch(std::make_move_iterator(fcs.begin()), std::make_move_iterator(fcs.end()), thread, priority);
+		fcs.clear();
+	}
+
+	// 期限付きタスクを追加 -> 通常のキューより先に、期限の早いものから実行される（EDF）
+	template <class FiberOrCb>
+	void scheduleDeadline(FiberOrCb&& fc, std::chrono::steady_clock::time_point deadline)
+	{
+		bool need_tickle;
+		// キャンセルトークンの子の作成はロックの外で行う
+		ScheduleTask task(std::forward<FiberOrCb>(fc), -1);
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_enqueueLockCount.fetch_add(1, std::memory_order_relaxed);
+			need_tickle = m_taskCount == 0;
+
+			if (task.fiber || task.cb) 
+			{
+				if(m_maxThreadCount)
+				{
+					task.enqueued = std::chrono::steady_clock::now();
+				}
+				task.deadline = deadline;
+				enqueue(std::move(task));
+				m_taskCount++;
+				m_enqueuedTaskCount.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+
+		if(need_tickle)
+		{
+			tickle();
+		}
+	}
+	
+	// 短いコールバックをファイバーを作らずにスケジューラファイバー上で直接実行する
+	// -> 実行中はフックが無効になる（ブロックする呼び出しはスレッドごと止める）ので、待機・yield しないこと
+	// フックされないので accept()・socket() で作った fd は FdCtx が作られない
+	// -> フック関数で使う fd は FdMgr::GetInstance()->get(fd, true) で登録すること
+	// 待機できないのでキャンセルトークンは引き継がない
+	// 実行時間の上限はない -> タイムスライスの監視も対象外で、終わるまで同じスレッドの他のタスクが待たされる
+	// 長くなりうる処理は scheduleLock() を使うこと
+	void scheduleInline(UniqueFunction cb, int thread = -1, Priority priority = PRIORITY_NORMAL)
+	{
+		bool need_tickle;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_enqueueLockCount.fetch_add(1, std::memory_order_relaxed);
+			need_tickle = m_taskCount == 0;
+
+			ScheduleTask task(&cb, thread);
+			if (task.cb) 
+			{
+				if(m_maxThreadCount)
+				{
+					task.enqueued = std::chrono::steady_clock::now();
+				}
+				task.priority = priority;
+				task.inlined = true;
+				m_tasks[priority].push_back(std::move(task));
+				m_taskCount++;
+				m_enqueuedTaskCount.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+
+		if(need_tickle)
+		{
+			tickle();
+		}
+	}
 	
 	virtual void start();
 	
 	virtual void stop();	
+
+	// 優先度クラス間の取り出し方 -> weights は DEQUEUE_WEIGHTED で各クラスから連続して取り出す数
+	void setDequeuePolicy(DequeuePolicy policy, const std::vector<int>& weights = {8, 4, 1});
+
+	// 期限を過ぎた期限付きタスクの扱い
+	void setDeadlinePolicy(DeadlinePolicy policy) {m_deadlinePolicy = policy;}
+	// 期限を過ぎてから取り出された期限付きタスク数
+	uint64_t getDeadlineMissCount() const {return m_deadlineMissCount;}
+
+	// タイムスライス: slice_ms を超えて実行中のファイバーを監視スレッドが検出し、
+	// 次のフック関数呼び出しかセーフポイントで実行権を譲らせる 0 -> 無効
+	void setPreemption(uint64_t slice_ms);
+	// タイムスライス超過の検出回数
+	uint64_t getPreemptCount() const {return m_preemptCount;}
+
+	// ワーカースレッドをCPUに固定する -> 実行中のスレッドと以後追加されるスレッドに適用
+	// i番目のワーカー（use_caller の場合はメインスレッドが0番）-> cpus[i % cpus.size()]
+	void setAffinity(AffinityPolicy policy, const std::vector<int>& cpus = {});
+
+	// 動的スレッド数: キュー待ち時間が latency_us を超えたら max_threads までスレッドを追加し、
+	// keepalive_ms の間アイドルだったスレッドは初期スレッド数まで退役させる max_threads = 0 -> 無効
+	// 固定されたタスク・共有スタックのファイバーが残っているスレッドは退役しない
+	void setDynamicThreads(size_t max_threads, uint64_t latency_us, uint64_t keepalive_ms);
+
+	// 現在のワーカースレッド数（use_caller の場合はメインスレッドを含む）
+	size_t getThreadCount() const {return m_liveThreadCount + (m_useCaller ? 1 : 0);}
+	// スレッド追加 / 退役の判断回数
+	uint64_t getGrowCount() const {return m_growCount;}
+	uint64_t getRetireCount() const {return m_retireCount;}
+
+	// キュー投入時のロック取得回数 / 投入されたタスク数 -> tasks per lock
+	uint64_t getEnqueueLockCount() const {return m_enqueueLockCount;}
+	uint64_t getEnqueuedTaskCount() const {return m_enqueuedTaskCount;}
 	
 protected:
 	virtual void tickle();
@@ -63,19 +287,40 @@ protected:
 
 	// アイドルコルーチン関数
 	virtual void idle();
+
+	// アイドルファイバーから戻り、タスクを実行し始める直前 -> アイドル中だけ受け持っていた処理を他のスレッドに任せる
+	virtual void leaveIdle() {}
 	
 	// 停止可能かどうか
 	virtual bool stopping();
 
 	bool hasIdleThreads() {return m_idleThreadCount>0;}
 
-private:
-	// タスク
+	// アイドルループから呼ぶ -> keepalive を超えてアイドルなら退役する（アイドルループを抜ける）
+	bool retiring();
+	// thread に固定されたタスクがキューにある（ロック済み）
+	bool hasPinnedTask(int thread);
+	// 退役できるまでの残り時間（ms） -> 退役の候補でなければ UINT64_MAX
+	// アイドルループの待機をこれで区切る -> 無期限に待つと退役できない
+	uint64_t retireWaitMs();
+
+protected:
+	// タスク -> ムーブのみ（キューへの投入・取り出し・実行で複製しない）
 	struct ScheduleTask
 	{
 		std::shared_ptr<Fiber> fiber;
-		std::function<void()> cb;
+		UniqueFunction cb;
 		int thread; // タスクを実行すべきスレッドID
+		// キュー投入時刻 -> 動的スレッド数が有効な場合のみ記録
+		std::chrono::steady_clock::time_point enqueued;
+		// 優先度クラス
+		int priority = PRIORITY_NORMAL;
+		// 期限 -> scheduleDeadline() と、期限付きで実行されたファイバーの場合のみ
+		std::chrono::steady_clock::time_point deadline;
+		// ファイバーを作らずにスケジューラファイバー上で実行する -> コールバックのみ
+		bool inlined = false;
+		// 呼び出し元から引き継いだキャンセルトークン -> 実行するファイバーに設定する
+		std::shared_ptr<CancellationToken> token;
 
 		ScheduleTask()
 		{
@@ -84,25 +329,42 @@ private:
 			thread = -1;
 		}
 
+		// 共有スタックのファイバー -> 固定されたスレッドでのみ実行できる
+		// 実行済みのファイバー -> 前回実行されたクラスに戻る
 		ScheduleTask(std::shared_ptr<Fiber> f, int thr)
 		{
-			fiber = f;
-			thread = thr;
+			fiber = std::move(f);
+			thread = (thr == -1 && fiber) ? fiber->getStackThread() : thr;
+			if(fiber && fiber->getPriority() >= 0)
+			{
+				priority = fiber->getPriority();
+				deadline = fiber->getDeadline();
+			}
 		}
 
 		ScheduleTask(std::shared_ptr<Fiber>* f, int thr)
 		{
 			fiber.swap(*f);
-			thread = thr;
+			thread = (thr == -1 && fiber) ? fiber->getStackThread() : thr;
+			if(fiber && fiber->getPriority() >= 0)
+			{
+				priority = fiber->getPriority();
+				deadline = fiber->getDeadline();
+			}
 		}	
 
-		ScheduleTask(std::function<void()> f, int thr)
+		// 呼び出し元のファイバーにキャンセルトークンがある -> 子トークンを引き継いで実行する
+		ScheduleTask(UniqueFunction f, int thr)
 		{
-			cb = f;
+			cb = std::move(f);
 			thread = thr;
+			if(cb)
+			{
+				token = CancellationToken::Inherit();
+			}
 		}		
 
-		ScheduleTask(std::function<void()>* f, int thr)
+		ScheduleTask(UniqueFunction* f, int thr)
 		{
 			cb.swap(*f);
 			thread = thr;
@@ -113,25 +375,104 @@ private:
 			fiber = nullptr;
 			cb = nullptr;
 			thread = -1;
+			enqueued = std::chrono::steady_clock::time_point();
+			priority = PRIORITY_NORMAL;
+			deadline = std::chrono::steady_clock::time_point();
+			inlined = false;
+			token.reset();
 		}	
+
+		// 期限付きタスクの最小ヒープ用の比較関数
+		static bool LaterDeadline(const ScheduleTask& lhs, const ScheduleTask& rhs)
+		{
+			return lhs.deadline > rhs.deadline;
+		}
 	};
 
+	// アイドルファイバーから呼ぶ -> 最初に実行可能なタスクはこのスレッドで直接実行し（runnext）、
+	// 残りを1回のロックでまとめて投入して必要な数だけスレッドを起こす
+	void scheduleTasks(std::vector<ScheduleTask>& tasks);
+
+	// 期限があれば期限付きタスクのヒープへ、なければ優先度クラスのキューへ（ロック済み）
+	void enqueue(ScheduleTask&& task);
+
+private:
+	// キュー待ち時間が閾値を超えた -> スレッドを1つ追加
+	// 呼び出しスレッドだけのスケジューラ（threads=1, use_caller）は stop() の中でしか run() しないので増えない
+	void addThread();
+
+	// i番目のワーカーを固定するCPU -1 -> 固定しない
+	int cpuForWorker(size_t i) const;
+
+	// ワーカーごとの実行中ファイバーの情報 -> 監視スレッドが参照する
+	struct WorkerSlot;
+	static thread_local WorkerSlot* t_slot;
+
+	// 監視スレッド関数
+	void monitor();
+	// 実行開始・終了をスロットに記録
+	void beginSlice(uint64_t fiber_id);
+	void endSlice();
+
 private:
 	std::string m_name;
 	// ミューテックス -> タスクキューを保護
 	std::mutex m_mutex;
 	// スレッドプール
 	std::vector<std::shared_ptr<Thread>> m_threads;
-	// タスク队列
-	std::vector<ScheduleTask> m_tasks;
+	// タスク队列 -> 優先度クラスごと
+	std::vector<ScheduleTask> m_tasks[PRIORITY_COUNT];
+	// 期限付きタスク -> 期限の最小ヒープ
+	std::vector<ScheduleTask> m_deadlineTasks;
+	// 全クラスのタスク数（期限付きタスクを含む）
+	size_t m_taskCount = 0;
+	std::atomic<DeadlinePolicy> m_deadlinePolicy = {DEADLINE_RUN};
+	std::atomic<uint64_t> m_deadlineMissCount = {0};
+	DequeuePolicy m_dequeuePolicy = DEQUEUE_STRICT;
+	int m_weights[PRIORITY_COUNT] = {8, 4, 1};
+	// DEQUEUE_WEIGHTED: 現在取り出しているクラスと残りの取り出し数
+	int m_wrrClass = PRIORITY_HIGH;
+	int m_wrrCredit = 8;
 	// ワーカースレッドのIDを格納
 	std::vector<int> m_threadIds;
 	// 追加作成が必要なスレッド数
 	size_t m_threadCount = 0;
+	// 現在動いているワーカースレッド数（メインスレッドを除く）
+	std::atomic<size_t> m_liveThreadCount = {0};
+	// 退役したスレッドのID -> 次の addThread() / stop() で join する
+	std::vector<int> m_retiredThreadIds;
+
+	// ポリシーから決まったCPUの並び -> 空なら固定しない
+	std::vector<int> m_cpus;
+
+	// タイムスライス（ms） 0 -> 無効
+	std::atomic<uint64_t> m_preemptSliceMs = {0};
+	std::atomic<uint64_t> m_preemptCount = {0};
+	// 監視スレッド
+	std::shared_ptr<Thread> m_monitorThread;
+	std::atomic<bool> m_monitorStop = {false};
+	// 全ワーカーのスロット
+	std::mutex m_slotMutex;
+	std::vector<std::shared_ptr<WorkerSlot>> m_slots;
+
+	// 動的スレッド数の上限（メインスレッドを除く） 0 -> 無効
+	std::atomic<size_t> m_maxThreadCount = {0};
+	// スレッドを追加するキュー待ち時間の閾値（us）
+	std::atomic<uint64_t> m_growLatencyUs = {0};
+	// アイドルスレッドを退役させるまでの時間（ms）
+	std::atomic<uint64_t> m_keepAliveMs = {0};
+	// 最後にスレッドを追加した時刻 -> 追加は閾値時間に1回まで
+	std::chrono::steady_clock::time_point m_lastGrow;
+	std::atomic<uint64_t> m_growCount = {0};
+	std::atomic<uint64_t> m_retireCount = {0};
 	// アクティブスレッド数
 	std::atomic<size_t> m_activeThreadCount = {0};
 	// アイドルスレッド数
 	std::atomic<size_t> m_idleThreadCount = {0};
+	// キュー投入時のロック取得回数
+	std::atomic<uint64_t> m_enqueueLockCount = {0};
+	// キューに投入されたタスク数
+	std::atomic<uint64_t> m_enqueuedTaskCount = {0};
 
 	// メインスレッドをワーカースレッドとして使うか
 	bool m_useCaller;
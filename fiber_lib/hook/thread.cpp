@@ -3,6 +3,8 @@
 #include <sys/syscall.h> 
 #include <iostream>
 #include <unistd.h>  
+#include <pthread.h>
+#include <sched.h>
 
 namespace sylar {
 
@@ -34,10 +36,22 @@ void Thread::SetName(const std::string &name)
     t_thread_name = name;
 }
 
-Thread::Thread(std::function<void()> cb, const std::string &name): 
-m_cb(cb), m_name(name) 
+Thread::Thread(std::function<void()> cb, const std::string &name, int cpu): 
+m_cpu(cpu), m_cb(cb), m_name(name) 
 {
-    int rt = pthread_create(&m_thread, nullptr, &Thread::run, this);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (cpu >= 0) 
+    {
+        // 最初から固定する -> スレッドが確保・初回アクセスするメモリはそのCPUのNUMAノードに載る
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+    }
+
+    int rt = pthread_create(&m_thread, &attr, &Thread::run, this);
+    pthread_attr_destroy(&attr);
     if (rt) 
     {
         std::cerr << "pthread_create thread fail, rt=" << rt << " name=" << name;
@@ -56,6 +70,26 @@ Thread::~Thread()
     }
 }
 
+bool Thread::setAffinity(int cpu) 
+{
+    if (!m_thread || cpu < 0) 
+    {
+        return false;
+    }
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    int rt = pthread_setaffinity_np(m_thread, sizeof(cpuset), &cpuset);
+    if (rt) 
+    {
+        std::cerr << "pthread_setaffinity_np failed, rt = " << rt << ", name = " << m_name << std::endl;
+        return false;
+    }
+    m_cpu = cpu;
+    return true;
+}
+
 void Thread::join() 
 {
     if (m_thread) 
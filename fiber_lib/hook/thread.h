@@ -43,11 +43,16 @@ public:
 class Thread 
 {
 public:
-    Thread(std::function<void()> cb, const std::string& name);
+    // cpu >= 0 -> 作成時にそのCPUに固定する
+    Thread(std::function<void()> cb, const std::string& name, int cpu = -1);
     ~Thread();
 
     pid_t getId() const { return m_id; }
     const std::string& getName() const { return m_name; }
+    int getCpu() const { return m_cpu; }
+
+    // 実行中のスレッドをCPUに固定する
+    bool setAffinity(int cpu);
 
     void join();
 
@@ -69,6 +74,8 @@ private:
 private:
     pid_t m_id = -1;
     pthread_t m_thread = 0;
+    // 固定先のCPU -1 -> 固定しない
+    int m_cpu = -1;
 
     // スレッドが実行すべき関数
     std::function<void()> m_cb;
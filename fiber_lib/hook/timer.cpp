@@ -1,47 +1,121 @@
 #include "timer.h"
 
+#include <cstdint>
+
 namespace sylar {
 
-bool Timer::cancel() 
+// タイマーのシャード -> ワーカーごとに1つ + 共有シャード
+struct TimerShard
 {
-    std::unique_lock<std::shared_mutex> write_lock(m_manager->m_mutex);
+    explicit TimerShard(TimerManager* mgr): manager(mgr)
+    {
+        previouseTime = std::chrono::system_clock::now();
+    }
 
-    if(m_cb == nullptr) 
+    TimerManager* manager;
+    // timers を保護 -> 通常は所有スレッドしか取らない
+    std::mutex mutex;
+    // 時間ヒープ
+    std::set<std::shared_ptr<Timer>, Timer::Comparator> timers;
+    // 期限切れ処理中に再追加を待つ繰り返しタイマー（ロック済み）-> 今回の処理で再び期限切れにしない
+    std::vector<std::set<std::shared_ptr<Timer>, Timer::Comparator>::node_type> rearmed;
+    // 先頭のタイムアウト時間（system_clock のカウント）-> ロックなしで読む
+    std::atomic<int64_t> next{INT64_MAX};
+    // 所有スレッドがアイドルで待機して起きる時刻 -> 待機していなければ INT64_MAX、計算中は INT64_MIN
+    // next より遅い（実行中など）-> 他のアイドルスレッドが代わりに期限切れにする
+    std::atomic<int64_t> wakeAt{INT64_MAX};
+    // 全シャードのリスト -> 追加のみで TimerManager の破棄まで解放しない（ロックなしでたどる）
+    TimerShard* nextShard = nullptr;
+    // 他のスレッドからキャンセルされたタイマー（ロックフリーのスタック）
+    std::atomic<Timer*> cancelled{nullptr};
+    // 最後にシステム時刻の巻き戻しを確認した絶対時間
+    std::chrono::time_point<std::chrono::system_clock> previouseTime;
+
+    // 他のスレッドからのキャンセルを反映（ロック済み）-> タイマー数はキャンセル時に減らしてある
+    void drainCancelled()
     {
-        return false;
+        Timer* timer = cancelled.exchange(nullptr, std::memory_order_acquire);
+        while(timer)
+        {
+            Timer* following = timer->m_cancelNext;
+            std::shared_ptr<Timer> self = std::move(timer->m_cancelSelf);
+            // 依頼後に共有シャードへ移った -> 移動先で期限切れ時に捨てられる
+            if(timer->m_shard == this)
+            {
+                auto it = timers.find(self);
+                if(it != timers.end())
+                {
+                    timers.erase(it);
+                }
+                timer->m_cb = nullptr;
+            }
+            timer = following;
+        }
+        updateNext();
     }
-    else
+
+    // 先頭が変わったとき -> この関数を呼ぶ（ロック済み）
+    // seq_cst -> addTimer() の m_tickled の exchange と getNextDeadline() の読み出しの順序を保証する
+    void updateNext()
     {
-        m_cb = nullptr;
+        next.store(timers.empty() ? INT64_MAX : (*timers.begin())->m_next.time_since_epoch().count(), std::memory_order_seq_cst);
     }
 
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it!=m_manager->m_timers.end())
+    // システム時間が変化したとき -> この関数を呼ぶ（ロック済み）
+    bool detectClockRollover()
     {
-        m_manager->m_timers.erase(it);
+        bool rollover = false;
+        auto now = std::chrono::system_clock::now();
+        if(now < (previouseTime - std::chrono::milliseconds(60 * 60 * 1000)))
+        {
+            rollover = true;
+        }
+        previouseTime = now;
+        return rollover;
     }
-    return true;
+};
+
+// このスレッドが確保したシャード
+static thread_local TimerShard* t_shard = nullptr;
+
+bool Timer::cancel() 
+{
+    // 期限切れ（繰り返しなし）と競合 -> 先に成立した方だけが有効
+    if(m_cancelled.exchange(true))
+    {
+        return false;
+    }
+    --m_manager->m_timerCount;
+    return m_manager->removeTimer(shared_from_this());
 }
 
-// refresh は後ろにしか移動しない
+// refresh は後ろにしか移動しない -> 所有スレッドの待ち時間が長くなるだけなので起こす必要はない
 bool Timer::refresh() 
 {
-    std::unique_lock<std::shared_mutex> write_lock(m_manager->m_mutex);
+    if(m_cancelled)
+    {
+        return false;
+    }
 
-    if(!m_cb) 
+    TimerShard* shard = m_shard;
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    // シャードを移動中
+    if(shard != m_shard || m_cancelled)
     {
         return false;
     }
 
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it==m_manager->m_timers.end())
+    auto it = shard->timers.find(shared_from_this());
+    if(it==shard->timers.end())
     {
         return false;
     }
 
-    m_manager->m_timers.erase(it);
-    m_next = std::chrono::system_clock::now() + std::chrono::milliseconds(m_ms);
-    m_manager->m_timers.insert(shared_from_this());
+    // ノードを付け替える -> 木のノードを確保し直さない
+    auto node = shard->timers.extract(it);
+    setNext(std::chrono::system_clock::now());
+    shard->timers.insert(std::move(node));
+    shard->updateNext();
     return true;
 }
 
@@ -53,54 +127,131 @@ bool Timer::reset(uint64_t ms, bool from_now)
     }
 
     {
-        std::unique_lock<std::shared_mutex> write_lock(m_manager->m_mutex);
-    
-        if(!m_cb) 
+        TimerShard* shard = m_shard;
+        std::lock_guard<std::mutex> lock(shard->mutex);
+
+        if(shard != m_shard || m_cancelled)
         {
             return false;
         }
-        
-        auto it = m_manager->m_timers.find(shared_from_this());
-        if(it==m_manager->m_timers.end())
+
+        auto it = shard->timers.find(shared_from_this());
+        if(it==shard->timers.end())
         {
             return false;
-        }   
-        m_manager->m_timers.erase(it); 
+        }
+        shard->timers.erase(it);
+        shard->updateNext();
     }
 
-    // 再挿入
-    auto start = from_now ? std::chrono::system_clock::now() : m_next - std::chrono::milliseconds(m_ms);
+    // 再挿入 -> 呼び出したスレッドのシャードへ（早まった場合に所有スレッドを起こせないため）
+    auto start = from_now ? std::chrono::system_clock::now() : m_scheduled - std::chrono::milliseconds(m_ms);
     m_ms = ms;
-    m_next = start + std::chrono::milliseconds(m_ms);
+    setNext(start);
     m_manager->addTimer(shared_from_this()); // insert with lock
     return true;
 }
 
-Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager):
-m_recurring(recurring), m_ms(ms), m_cb(cb), m_manager(manager) 
+void Timer::setRecurrence(Recurrence recurrence, CatchUp catch_up)
+{
+    while(true)
+    {
+        TimerShard* shard = m_shard;
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        // シャードを移動中 -> 移動先のロックを取り直す
+        if(shard != m_shard)
+        {
+            continue;
+        }
+        m_recurrence = recurrence;
+        m_catchUp = catch_up;
+        return;
+    }
+}
+
+Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring, uint64_t slack, TimerManager* manager):
+m_recurring(recurring), m_ms(ms), m_slack(slack), m_cb(cb), m_manager(manager) 
 {
     auto now = std::chrono::system_clock::now();
-    m_next = now + std::chrono::milliseconds(m_ms);
+    setNext(now);
+}
+
+void Timer::setNext(std::chrono::time_point<std::chrono::system_clock> base)
+{
+    m_scheduled = base + std::chrono::milliseconds(m_ms);
+    m_next = m_scheduled;
+    if(m_slack > 1)
+    {
+        // 同じ境界に切り上げられたタイマーは同じ時刻になり、1回の起床でまとめて期限切れになる
+        auto slack = std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::milliseconds(m_slack));
+        auto rem = m_next.time_since_epoch() % slack;
+        if(rem.count() != 0)
+        {
+            m_next += slack - rem;
+        }
+    }
+}
+
+size_t Timer::advance(std::chrono::time_point<std::chrono::system_clock> now, bool rollover)
+{
+    // 固定遅延・時刻の巻き戻し -> 処理した時刻から（周期 0 -> 次回の listExpiredCb() で実行）
+    if(m_recurrence == FIXED_DELAY || rollover || m_ms == 0)
+    {
+        setNext(now);
+        return 1;
+    }
+
+    auto period = std::chrono::milliseconds(m_ms);
+    auto scheduled = m_scheduled;
+    size_t runs = 1;
+    // 1周期以上遅れた -> 遅れた周期を飛ばす（BURST の場合はその分も実行する）
+    if(scheduled + period <= now)
+    {
+        auto missed = (now - scheduled) / period;
+        scheduled += missed * period;
+        if(m_catchUp == CATCHUP_BURST)
+        {
+            runs += missed;
+        }
+    }
+    setNext(scheduled);
+    return runs;
 }
 
 bool Timer::Comparator::operator()(const std::shared_ptr<Timer>& lhs, const std::shared_ptr<Timer>& rhs) const
 {
     assert(lhs!=nullptr&&rhs!=nullptr);
-    return lhs->m_next < rhs->m_next;
+    // slack で同じ時刻になったタイマーも区別する
+    if(lhs->m_next != rhs->m_next)
+    {
+        return lhs->m_next < rhs->m_next;
+    }
+    return lhs.get() < rhs.get();
 }
 
 TimerManager::TimerManager() 
 {
-    m_previouseTime = std::chrono::system_clock::now();
+    m_sharedShard.reset(new TimerShard(this));
 }
 
 TimerManager::~TimerManager() 
 {
+    // キャンセル待ちリストのタイマーは自分を保持している -> 解放する
+    m_sharedShard->drainCancelled();
+    for(auto& shard : m_shards)
+    {
+        shard->drainCancelled();
+    }
 }
 
-std::shared_ptr<Timer> TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring) 
+std::shared_ptr<Timer> TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring, uint64_t slack) 
 {
-    std::shared_ptr<Timer> timer(new Timer(ms, cb, recurring, this));
+    if(slack == DEFAULT_SLACK)
+    {
+        slack = m_defaultSlack.load(std::memory_order_relaxed);
+    }
+    std::shared_ptr<Timer> timer(new Timer(ms, cb, recurring, slack, this));
+    ++m_timerCount;
     addTimer(timer);
     return timer;
 }
@@ -115,109 +266,424 @@ static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb)
     }
 }
 
-std::shared_ptr<Timer> TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring) 
+std::shared_ptr<Timer> TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring, uint64_t slack) 
 {
-    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
+    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring, slack);
 }
 
-uint64_t TimerManager::getNextTimer()
+// 自分のシャード・共有シャード・所有スレッドが期限までに起きないシャードのうち最も近い絶対タイムアウト時間
+std::chrono::time_point<std::chrono::system_clock> TimerManager::getNextDeadline()
 {
-    std::shared_lock<std::shared_mutex> read_lock(m_mutex);
-    
     // reset m_tickled
-    m_tickled = false;
-    
-    if (m_timers.empty())
+    // 追加側は next の書き込み -> m_tickled の exchange、こちらは m_tickled の書き込み -> next の読み出し
+    // どちらも seq_cst -> 少なくとも一方が相手の書き込みを見る（起床の取りこぼしがない）
+    m_tickled.store(false, std::memory_order_seq_cst);
+
+    TimerShard* own = currentShard();
+    int64_t next_count;
+    if(own == m_sharedShard.get())
+    {
+        next_count = collectNext(own);
+    }
+    else
+    {
+        // 起きる時刻を公開してから読み直す -> 公開前に他のシャードの先頭に入ったタイマーも見落とさない
+        // （追加側は next の書き込み -> wakeAt の読み出しなので、少なくとも一方が相手の書き込みを見る）
+        own->wakeAt.store(INT64_MIN, std::memory_order_seq_cst);
+        next_count = collectNext(own);
+        while(true)
+        {
+            own->wakeAt.store(next_count, std::memory_order_seq_cst);
+            int64_t again = collectNext(own);
+            if(again >= next_count)
+            {
+                break;
+            }
+            next_count = again;
+        }
+    }
+
+    if (next_count == INT64_MAX)
+    {
+        return std::chrono::time_point<std::chrono::system_clock>::max();
+    }
+    return std::chrono::time_point<std::chrono::system_clock>(std::chrono::system_clock::duration(next_count));
+}
+
+int64_t TimerManager::collectNext(TimerShard* own)
+{
+    // 各シャードが公開している先頭のタイムアウト時間 -> ロックは取らない
+    int64_t next_count = m_sharedShard->next.load(std::memory_order_seq_cst);
+    if(own != m_sharedShard.get())
+    {
+        next_count = std::min(next_count, own->next.load(std::memory_order_seq_cst));
+    }
+    for(TimerShard* shard = m_shardList.load(std::memory_order_acquire); shard; shard = shard->nextShard)
+    {
+        if(shard == own)
+        {
+            continue;
+        }
+        int64_t next = shard->next.load(std::memory_order_seq_cst);
+        if(shard->wakeAt.load(std::memory_order_seq_cst) > next)
+        {
+            next_count = std::min(next_count, next);
+        }
+    }
+    return next_count;
+}
+
+void TimerManager::coverDeadline(int64_t next_count)
+{
+    if(next_count == INT64_MAX)
+    {
+        return;
+    }
+    // 期限までに起きるアイドルスレッドがいる -> そのスレッドが代わりに期限切れにする
+    for(TimerShard* shard = m_shardList.load(std::memory_order_acquire); shard; shard = shard->nextShard)
+    {
+        if(shard->wakeAt.load(std::memory_order_seq_cst) <= next_count)
+        {
+            return;
+        }
+    }
+    // only tickle once till one thread wakes up and runs getNextDeadline()
+    if(!m_tickled.exchange(true, std::memory_order_seq_cst))
+    {
+        onTimerInsertedAtFront();
+    }
+}
+
+void TimerManager::leaveTimerWait(bool busy)
+{
+    if(!t_shard || t_shard->manager != this)
+    {
+        return;
+    }
+    t_shard->wakeAt.store(INT64_MAX, std::memory_order_seq_cst);
+    if(busy)
+    {
+        coverDeadline(t_shard->next.load(std::memory_order_seq_cst));
+    }
+}
+
+// 自分のシャードと共有シャードのうち最も近いタイムアウト時間
+uint64_t TimerManager::getNextTimer()
+{
+    auto next = getNextDeadline();
+    if (next == std::chrono::time_point<std::chrono::system_clock>::max())
     {
         // 最大値を返す
         return ~0ull;
     }
 
     auto now = std::chrono::system_clock::now();
-    auto time = (*m_timers.begin())->m_next;
-
-    if(now>=time)
+    if(now>=next)
     {
         // すでにタイマーがタイムアウトしている
         return 0;
     }
     else
     {
-        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(time - now);
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(next - now);
         return static_cast<uint64_t>(duration.count());            
-    }  
+    }
 }
 
 void TimerManager::listExpiredCb(std::vector<std::function<void()>>& cbs)
 {
     auto now = std::chrono::system_clock::now();
+    size_t expired = 0;
+
+    TimerShard* own = currentShard();
+    if(own != m_sharedShard.get())
+    {
+        std::lock_guard<std::mutex> lock(own->mutex);
+        expired += expireShard(own, now, cbs);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_sharedShard->mutex);
+        expired += expireShard(m_sharedShard.get(), now, cbs);
+    }
+
+    // 所有スレッドが実行中で期限を過ぎたシャード -> 代わりに期限切れにする（所有スレッドが処理中なら任せる）
+    int64_t now_count = now.time_since_epoch().count();
+    for(TimerShard* shard = m_shardList.load(std::memory_order_acquire); shard; shard = shard->nextShard)
+    {
+        if(shard == own)
+        {
+            continue;
+        }
+        int64_t next = shard->next.load(std::memory_order_seq_cst);
+        if(next > now_count || shard->wakeAt.load(std::memory_order_seq_cst) <= next)
+        {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(shard->mutex, std::try_to_lock);
+        if(lock.owns_lock())
+        {
+            expired += expireShard(shard, now, cbs);
+        }
+    }
+
+    if(expired > 0)
+    {
+        ++m_expireBatchCount;
+        m_expiredTimerCount += expired;
+    }
+}
+
+size_t TimerManager::expireShard(TimerShard* shard, std::chrono::time_point<std::chrono::system_clock> now, std::vector<std::function<void()>>& cbs)
+{
+    shard->drainCancelled();
+
+    bool rollover = shard->detectClockRollover();
+    std::set<std::shared_ptr<Timer>, Timer::Comparator>& timers = shard->timers;
 
-    std::unique_lock<std::shared_mutex> write_lock(m_mutex); 
+    // 同じ境界に切り上げられた slack 付きのタイマー -> 1つのタスクとしてまとめて実行する
+    std::vector<std::function<void()>> bucket;
+    std::chrono::time_point<std::chrono::system_clock> bucket_time;
+    auto flush = [&]()
+    {
+        if(bucket.size() == 1)
+        {
+            cbs.push_back(std::move(bucket.front()));
+        }
+        else if(!bucket.empty())
+        {
+            cbs.push_back([batch = std::move(bucket)]()
+            {
+                for(auto& cb : batch)
+                {
+                    cb();
+                }
+            });
+        }
+        bucket.clear();
+    };
+    size_t expired = 0;
+    auto emit = [&](const std::shared_ptr<Timer>& timer, std::chrono::time_point<std::chrono::system_clock> due, std::function<void()> cb)
+    {
+        ++expired;
+        if(timer->m_slack <= 1)
+        {
+            cbs.push_back(std::move(cb));
+            return;
+        }
+        if(!bucket.empty() && bucket_time != due)
+        {
+            flush();
+        }
+        bucket_time = due;
+        bucket.push_back(std::move(cb));
+    };
 
-    bool rollover = detectClockRollover();
-    
     // 巻き戻し -> すべてのタイマーを削除 || タイムアウト -> タイムアウトしたタイマーを削除
-    while (!m_timers.empty() && rollover || !m_timers.empty() && (*m_timers.begin())->m_next <= now)
+    while (!timers.empty() && rollover || !timers.empty() && (*timers.begin())->m_next <= now)
     {
-        std::shared_ptr<Timer> temp = *m_timers.begin();
-        m_timers.erase(m_timers.begin());
-        
-        cbs.push_back(temp->m_cb); 
+        auto node = timers.extract(timers.begin());
+        std::shared_ptr<Timer> temp = node.value();
 
         if (temp->m_recurring)
         {
-            // 時間ヒープに再追加
-            temp->m_next = now + std::chrono::milliseconds(temp->m_ms);
-            m_timers.insert(temp);
+            // キャンセル済み -> 再追加しない
+            if(temp->m_cancelled)
+            {
+                temp->m_cb = nullptr;
+                continue;
+            }
+            auto due = temp->m_next;
+            size_t runs = temp->advance(now, rollover);
+            if(runs == 1)
+            {
+                emit(temp, due, temp->m_cb);
+            }
+            else
+            {
+                emit(temp, due, [cb = temp->m_cb, runs]()
+                {
+                    for(size_t i = 0; i < runs; ++i)
+                    {
+                        cb();
+                    }
+                });
+            }
+
+            // ノードごと時間ヒープに再追加 -> 木のノードを確保し直さない
+            shard->rearmed.push_back(std::move(node));
         }
         else
         {
+            // キャンセルと競合 -> キャンセルが先なら実行しない
+            if(!temp->m_cancelled.exchange(true))
+            {
+                --m_timerCount;
+                emit(temp, temp->m_next, std::move(temp->m_cb));
+            }
             // cb を削除
             temp->m_cb = nullptr;
         }
     }
+    for(auto& node : shard->rearmed)
+    {
+        timers.insert(std::move(node));
+    }
+    shard->rearmed.clear();
+    flush();
+    shard->updateNext();
+    return expired;
 }
 
+// キャンセル・実行済みでないタイマーの数 -> キャンセル待ちリストにあるものは含まない
 bool TimerManager::hasTimer() 
 {
-    std::shared_lock<std::shared_mutex> read_lock(m_mutex);
-    return !m_timers.empty();
+    return m_timerCount > 0;
 }
 
-// lock + tickle()
-void TimerManager::addTimer(std::shared_ptr<Timer> timer)
+TimerShard* TimerManager::currentShard()
 {
-    bool at_front = false;
+    if(t_shard && t_shard->manager == this)
+    {
+        return t_shard;
+    }
+    return m_sharedShard.get();
+}
+
+void TimerManager::claimShard()
+{
+    if(t_shard && t_shard->manager == this)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_shardsMutex);
+    if(!m_freeShards.empty())
+    {
+        t_shard = m_freeShards.back();
+        m_freeShards.pop_back();
+    }
+    else
+    {
+        m_shards.emplace_back(new TimerShard(this));
+        t_shard = m_shards.back().get();
+        t_shard->nextShard = m_shardList.load(std::memory_order_relaxed);
+        m_shardList.store(t_shard, std::memory_order_release);
+    }
+}
+
+void TimerManager::releaseShard()
+{
+    if(!t_shard || t_shard->manager != this)
     {
-        std::unique_lock<std::shared_mutex> write_lock(m_mutex);
-        auto it = m_timers.insert(timer).first;
-        at_front = (it == m_timers.begin()) && !m_tickled;
-        
-        // only tickle once till one thread wakes up and runs getNextTime()
-        if(at_front)
+        return;
+    }
+    TimerShard* shard = t_shard;
+    t_shard = nullptr;
+
+    bool moved = false;
+    {
+        std::scoped_lock lock(shard->mutex, m_sharedShard->mutex);
+        shard->drainCancelled();
+        for(auto& timer : shard->timers)
         {
-            m_tickled = true;
+            timer->m_shard = m_sharedShard.get();
+            insertTimer(m_sharedShard.get(), timer);
         }
+        moved = !shard->timers.empty();
+        shard->timers.clear();
+        shard->updateNext();
+        shard->wakeAt.store(INT64_MAX, std::memory_order_seq_cst);
+        m_sharedShard->updateNext();
     }
-   
-    if(at_front)
+
+    {
+        std::lock_guard<std::mutex> lock(m_shardsMutex);
+        m_freeShards.push_back(shard);
+    }
+
+    // 残っているワーカーが共有シャードとして処理する
+    if(moved)
     {
-        // wake up
         onTimerInsertedAtFront();
     }
 }
 
-bool TimerManager::detectClockRollover() 
+bool TimerManager::removeTimer(const std::shared_ptr<Timer>& timer)
 {
-    bool rollover = false;
-    auto now = std::chrono::system_clock::now();
-    if(now < (m_previouseTime - std::chrono::milliseconds(60 * 60 * 1000))) 
+    TimerShard* shard = timer->m_shard;
+
+    // 所有スレッドから・共有シャード -> その場で削除
+    if(shard == t_shard || shard == m_sharedShard.get())
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        // ロック待ちの間に共有シャードへ移った -> 移動先で期限切れ時に捨てられる
+        if(timer->m_shard != shard)
+        {
+            return true;
+        }
+        auto it = shard->timers.find(timer);
+        if(it!=shard->timers.end())
+        {
+            shard->timers.erase(it);
+            shard->updateNext();
+        }
+        timer->m_cb = nullptr;
+        return true;
+    }
+
+    // 他のスレッドのシャード -> 所有スレッドが次の listExpiredCb() で取り除く
+    timer->m_cancelSelf = timer;
+    Timer* head = shard->cancelled.load(std::memory_order_relaxed);
+    do
     {
-        rollover = true;
+        timer->m_cancelNext = head;
+    } while(!shard->cancelled.compare_exchange_weak(head, timer.get(), std::memory_order_release, std::memory_order_relaxed));
+    return true;
+}
+
+// ロック済み -> 先頭に入ったかどうか
+bool TimerManager::insertTimer(TimerShard* shard, const std::shared_ptr<Timer>& timer)
+{
+    auto result = shard->timers.insert(timer);
+    if(result.first != shard->timers.begin())
+    {
+        return false;
     }
-    m_previouseTime = now;
-    return rollover;
+    shard->updateNext();
+    return true;
 }
 
+// lock + tickle()
+void TimerManager::addTimer(std::shared_ptr<Timer> timer)
+{
+    TimerShard* shard = currentShard();
+    bool at_front = false;
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        timer->m_shard = shard;
+        at_front = insertTimer(shard, timer);
+    }
+
+    if(!at_front)
+    {
+        return;
+    }
+
+    // 自分のシャード -> アイドルループに戻れば自分で処理するが、実行中に期限が来るかもしれない
+    // -> 期限までに起きるアイドルスレッドがいなければ1つ起こす
+    if(shard != m_sharedShard.get())
+    {
+        coverDeadline(timer->m_next.time_since_epoch().count());
+        return;
+    }
+
+    // 共有シャード -> only tickle once till one thread wakes up and runs getNextTime()
+    if(!m_tickled.exchange(true, std::memory_order_seq_cst))
+    {
+        // wake up
+        onTimerInsertedAtFront();
+    }
 }
 
+}
@@ -8,36 +8,79 @@
 #include <assert.h>
 #include <functional>
 #include <mutex>
+#include <atomic>
+#include <chrono>
 
 namespace sylar {
 
 class TimerManager;
+struct TimerShard;
 
 class Timer : public std::enable_shared_from_this<Timer> 
 {
     friend class TimerManager;
+    friend struct TimerShard;
 public:
+    // 繰り返しタイマーの次回のタイムアウト時間の決め方
+    enum Recurrence
+    {
+        // 期限切れを処理した時刻から m_ms 後（既定）-> 処理の遅れの分だけ周期がずれていく
+        FIXED_DELAY,
+        // 前回の予定時刻から m_ms 後 -> 周期がずれない
+        FIXED_RATE
+    };
+
+    // FIXED_RATE で1周期以上遅れたとき
+    enum CatchUp
+    {
+        // 遅れた周期は実行せず、次の予定時刻に合わせる（既定）
+        CATCHUP_SKIP,
+        // 遅れた周期の数だけ続けて実行する
+        CATCHUP_BURST
+    };
+
     // 時間ヒープからタイマーを削除
     bool cancel();
     // タイマーをリフレッシュ
     bool refresh();
     // タイマーのタイムアウト時間を再設定
     bool reset(uint64_t ms, bool from_now);
+    // 繰り返しタイマーの周期の取り方を設定
+    void setRecurrence(Recurrence recurrence, CatchUp catch_up = CATCHUP_SKIP);
 
 private:
-    Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager);
+    Timer(uint64_t ms, std::function<void()> cb, bool recurring, uint64_t slack, TimerManager* manager);
+
+    // base + m_ms を m_scheduled に、それを m_slack の境界に切り上げて m_next に設定
+    void setNext(std::chrono::time_point<std::chrono::system_clock> base);
+    // 期限切れになった繰り返しタイマーの次回のタイムアウト時間を設定（ロック済み）-> 今回実行する回数
+    size_t advance(std::chrono::time_point<std::chrono::system_clock> now, bool rollover);
  
 private:
     // ループするかどうか
     bool m_recurring = false;
+    // シャードのロックで保護
+    Recurrence m_recurrence = FIXED_DELAY;
+    CatchUp m_catchUp = CATCHUP_SKIP;
     // タイムアウト時間
     uint64_t m_ms = 0;
+    // 許容する遅れ（ms）-> 絶対タイムアウト時間をこの境界に切り上げ、同じ境界のタイマーをまとめて期限切れにする
+    uint64_t m_slack = 0;
     // 絶対タイムアウト時間
     std::chrono::time_point<std::chrono::system_clock> m_next;
+    // 切り上げる前の予定時刻 -> FIXED_RATE の周期はここから数える（切り上げの分だけ周期が延びない）
+    std::chrono::time_point<std::chrono::system_clock> m_scheduled;
     // タイムアウト時に実行されるコールバック関数
     std::function<void()> m_cb;
     // このタイマーを管理するマネージャ
     TimerManager* m_manager = nullptr;
+    // キャンセル済み・実行済み（繰り返しなし）-> キャンセルと期限切れのどちらか一方だけが成立する
+    std::atomic<bool> m_cancelled{false};
+    // 所属するシャード
+    std::atomic<TimerShard*> m_shard{nullptr};
+    // 他のスレッドからのキャンセル待ちリスト -> 所有スレッドが取り除くまで自分を保持する
+    std::shared_ptr<Timer> m_cancelSelf;
+    Timer* m_cancelNext = nullptr;
 
 private:
     // 最小ヒープ用の比較関数
@@ -54,21 +97,44 @@ public:
     TimerManager();
     virtual ~TimerManager();
 
-    // タイマーを追加
-    std::shared_ptr<Timer> addTimer(uint64_t ms, std::function<void()> cb, bool recurring = false);
+    // slack にこの値を渡す -> setDefaultSlack() の値を使う
+    static const uint64_t DEFAULT_SLACK = ~0ull;
+
+    // タイマーを追加 -> slack (ms) だけ遅れてもよい（0 -> 切り上げない）
+    std::shared_ptr<Timer> addTimer(uint64_t ms, std::function<void()> cb, bool recurring = false, uint64_t slack = DEFAULT_SLACK);
 
     // 条件付きタイマーを追加
-    std::shared_ptr<Timer> addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring = false);
+    std::shared_ptr<Timer> addConditionTimer(uint64_t ms, std::function<void()> cb, std::weak_ptr<void> weak_cond, bool recurring = false, uint64_t slack = DEFAULT_SLACK);
+
+    // slack を指定しないタイマーの slack (ms) -> フックしたソケットのタイムアウトにも適用される（sleep には適用しない）0 -> 無効
+    void setDefaultSlack(uint64_t slack) {m_defaultSlack = slack;}
 
-    // ヒープ内の最も近いタイムアウト時間を取得
+    // 期限切れのタイマーを1つ以上取り出した listExpiredCb() の回数 / 取り出したタイマー数 -> timers per batch
+    uint64_t getExpireBatchCount() const {return m_expireBatchCount;}
+    uint64_t getExpiredTimerCount() const {return m_expiredTimerCount;}
+
+    // ヒープ内の最も近いタイムアウト時間を取得 -> ロックは取らない
     uint64_t getNextTimer();
+    // 最も近い絶対タイムアウト時間 -> タイマーがなければ time_point::max()
+    // シャードを確保したスレッド（アイドルループ）-> この時刻を起きる時刻として公開する
+    std::chrono::time_point<std::chrono::system_clock> getNextDeadline();
 
-    // すべてのタイムアウト済みタイマーのコールバック関数を取得
+    // すべてのタイムアウト済みタイマーのコールバック関数を取得 -> 同じ境界の slack 付きタイマーは1つにまとめる
     void listExpiredCb(std::vector<std::function<void()>>& cbs);
 
     // ヒープにタイマーがあるかどうか
     bool hasTimer();
 
+    // このスレッド専用のシャードを確保 -> 以後このスレッドで追加したタイマーはこのシャードに入り、
+    // 期限切れは通常このスレッドの listExpiredCb() が処理する（確保していないスレッドは共有シャードを使う）
+    // このスレッドがタスクを実行中で期限を過ぎた -> 他のアイドルスレッドが代わりに処理する
+    void claimShard();
+    // シャードを手放す -> 残りのタイマーは共有シャードに移す
+    void releaseShard();
+    // アイドルループの待機を抜けた -> busy ならタスクを実行するので、
+    // 自分のシャードの期限までに起きるアイドルスレッドがいなければ1つ起こす（代わりに期限切れにさせる）
+    void leaveTimerWait(bool busy);
+
 protected:
     // 最も早いタイマーがヒープに追加されたとき -> この関数を呼ぶ
     virtual void onTimerInsertedAtFront() {};
@@ -77,17 +143,42 @@ protected:
     void addTimer(std::shared_ptr<Timer> timer);
 
 private:
-    // システム時間が変化したとき -> この関数を呼ぶ
-    bool detectClockRollover();
+    // このスレッドが使うシャード -> 確保していなければ共有シャード
+    TimerShard* currentShard();
+
+    // own・共有シャード・所有スレッドが期限までに起きない他のシャードの最も近いタイムアウト時間
+    int64_t collectNext(TimerShard* own);
+    // next_count までに起きるアイドルスレッドがいなければ1つ起こす
+    void coverDeadline(int64_t next_count);
+
+    // タイマーを削除する -> 所有スレッド以外からはロックフリーのリストで所有スレッドに依頼する
+    bool removeTimer(const std::shared_ptr<Timer>& timer);
+
+    // シャードに挿入する（ロック済み）-> 先頭に入ったかどうか
+    bool insertTimer(TimerShard* shard, const std::shared_ptr<Timer>& timer);
+
+    // シャードを1つ処理する（ロック済み）-> 期限切れにしたタイマー数
+    size_t expireShard(TimerShard* shard, std::chrono::time_point<std::chrono::system_clock> now, std::vector<std::function<void()>>& cbs);
 
 private:
-    std::shared_mutex m_mutex;
-    // 時間ヒープ
-    std::set<std::shared_ptr<Timer>, Timer::Comparator> m_timers;
+    // 確保していないスレッドが使う共有シャード -> どのワーカーも期限切れを処理する
+    std::unique_ptr<TimerShard> m_sharedShard;
+    // m_shards・m_freeShards を保護
+    std::mutex m_shardsMutex;
+    // ワーカーごとのシャード
+    std::vector<std::unique_ptr<TimerShard>> m_shards;
+    // 手放されたシャード -> 次に確保するスレッドが再利用する
+    std::vector<TimerShard*> m_freeShards;
+    // m_shards の先頭 -> ロックなしでたどるリスト（TimerShard::nextShard）
+    std::atomic<TimerShard*> m_shardList{nullptr};
+    // 全シャードの有効なタイマー数（キャンセル・実行済みを除く）
+    std::atomic<size_t> m_timerCount{0};
     // 次回のgetNextTime()実行前にonTimerInsertedAtFront()が呼び出されたか -> この間に一度だけ呼ばれる
-    bool m_tickled = false;
-    // 最後にシステム時刻の巻き戻しを確認した絶対時間
-    std::chrono::time_point<std::chrono::system_clock> m_previouseTime;
+    // 共有シャードへの追加だけが立てる（自分のシャードへの追加は起こす必要がない）
+    std::atomic<bool> m_tickled{false};
+    std::atomic<uint64_t> m_defaultSlack{0};
+    std::atomic<uint64_t> m_expireBatchCount{0};
+    std::atomic<uint64_t> m_expiredTimerCount{0};
 };
 
 }
@@ -0,0 +1,229 @@
+#ifndef _UNIQUE_FUNCTION_H_
+#define _UNIQUE_FUNCTION_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+
+namespace sylar {
+
+// 呼び出し元のタグ付きの関数オブジェクト -> WithCallsite() で作る
+template <class F>
+struct Callsite
+{
+	const char* tag;
+	F fn;
+
+	void operator()() {fn();}
+};
+
+// スタック計測のキーを tag にする -> std::bind など型だけでは呼び出し元を区別できない場合に使う
+template <class F>
+Callsite<typename std::decay<F>::type> WithCallsite(const char* tag, F&& f)
+{
+	return {tag, std::forward<F>(f)};
+}
+
+// ムーブ専用の void() 関数オブジェクト
+// std::function と違いコピーできないが、INLINE_SIZE 以下のオブジェクトはヒープを使わずに内部バッファに置く
+// タスクはキュー投入から実行まで常にムーブされるので、ラムダのキャプチャが複製されることはない
+class UniqueFunction
+{
+public:
+	// 内部バッファのサイズ -> これを超えるオブジェクトはヒープに置く
+	static const size_t INLINE_SIZE = 64;
+
+	UniqueFunction() noexcept {}
+	UniqueFunction(std::nullptr_t) noexcept {}
+
+	template <class F, class = typename std::enable_if<
+		!std::is_same<typename std::decay<F>::type, UniqueFunction>::value &&
+		std::is_invocable_r<void, typename std::decay<F>::type&>::value>::type>
+	UniqueFunction(F&& f)
+	{
+		typedef typename std::decay<F>::type Fn;
+		// 空の std::function・関数ポインタ -> 空のまま
+		if(IsNull(f))
+		{
+			return;
+		}
+
+		// コンパイル時に分岐 -> 収まらない型のバッファへの配置 new を生成しない
+		if constexpr(FitsInline<Fn>())
+		{
+			new (m_buf) Fn(std::forward<F>(f));
+			m_ops = &InlineOps<Fn>::ops;
+		}
+		else
+		{
+			*reinterpret_cast<Fn**>(m_buf) = new Fn(std::forward<F>(f));
+			m_ops = &HeapOps<Fn>::ops;
+			s_heapAllocCount.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	UniqueFunction(UniqueFunction&& other) noexcept
+	{
+		moveFrom(other);
+	}
+
+	UniqueFunction& operator=(UniqueFunction&& other) noexcept
+	{
+		if(this != &other)
+		{
+			clear();
+			moveFrom(other);
+		}
+		return *this;
+	}
+
+	UniqueFunction& operator=(std::nullptr_t) noexcept
+	{
+		clear();
+		return *this;
+	}
+
+	UniqueFunction(const UniqueFunction&) = delete;
+	UniqueFunction& operator=(const UniqueFunction&) = delete;
+
+	~UniqueFunction() {clear();}
+
+	void operator()() {m_ops->invoke(m_buf);}
+
+	explicit operator bool() const noexcept {return m_ops != nullptr;}
+
+	void swap(UniqueFunction& other) noexcept
+	{
+		UniqueFunction tmp(std::move(other));
+		other = std::move(*this);
+		*this = std::move(tmp);
+	}
+
+	// 保持している関数オブジェクトの型 -> std::function から構築した場合はその中身の型
+	const std::type_info& target_type() const noexcept
+	{
+		return m_ops ? m_ops->type(m_buf) : typeid(void);
+	}
+
+	// 呼び出し元のキー -> ラムダは型（定義箇所ごとに異なる）、関数ポインタは型とアドレス、
+	// WithCallsite() はそのタグ 空 -> 空文字列
+	std::string callsite() const
+	{
+		return m_ops ? m_ops->callsite(m_buf) : std::string();
+	}
+
+	// 内部バッファに収まらずヒープに確保した回数（全インスタンスの累計）
+	static uint64_t GetHeapAllocCount() {return s_heapAllocCount.load(std::memory_order_relaxed);}
+
+private:
+	struct Ops
+	{
+		void (*invoke)(void* buf);
+		// src のバッファから dst のバッファへムーブし、src 側を破棄する
+		void (*move)(void* dst, void* src);
+		void (*destroy)(void* buf);
+		const std::type_info& (*type)(const void* buf);
+		std::string (*callsite)(const void* buf);
+	};
+
+	template <class Fn>
+	static constexpr bool FitsInline()
+	{
+		return sizeof(Fn) <= INLINE_SIZE && alignof(Fn) <= alignof(std::max_align_t) &&
+			std::is_nothrow_move_constructible<Fn>::value;
+	}
+
+	template <class Fn>
+	static bool IsNull(const Fn&) {return false;}
+	static bool IsNull(const std::function<void()>& f) {return !f;}
+	template <class R, class... Args>
+	static bool IsNull(R (*f)(Args...)) {return f == nullptr;}
+
+	template <class Fn>
+	static const std::type_info& TypeOf(const Fn&) {return typeid(Fn);}
+	static const std::type_info& TypeOf(const std::function<void()>& f) {return f.target_type();}
+
+	// 同じ型の関数ポインタは区別できない -> アドレスを付ける
+	static std::string AddressKey(const char* type, const void* addr)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "@%p", addr);
+		return std::string(type) + buf;
+	}
+
+	template <class Fn>
+	static std::string KeyOf(const Fn&) {return typeid(Fn).name();}
+	template <class R, class... Args>
+	static std::string KeyOf(R (*f)(Args...)) {return AddressKey(typeid(f).name(), (const void*)f);}
+	static std::string KeyOf(const std::function<void()>& f)
+	{
+		void (* const* p)() = f.target<void(*)()>();
+		return p ? AddressKey(f.target_type().name(), (const void*)*p) : std::string(f.target_type().name());
+	}
+	template <class F>
+	static std::string KeyOf(const Callsite<F>& f) {return f.tag;}
+
+	template <class Fn>
+	struct InlineOps
+	{
+		static Fn* get(void* buf) {return std::launder(reinterpret_cast<Fn*>(buf));}
+		static void invoke(void* buf) {(*get(buf))();}
+		static void move(void* dst, void* src)
+		{
+			new (dst) Fn(std::move(*get(src)));
+			get(src)->~Fn();
+		}
+		static void destroy(void* buf) {get(buf)->~Fn();}
+		static const std::type_info& type(const void* buf) {return TypeOf(*get(const_cast<void*>(buf)));}
+		static std::string callsite(const void* buf) {return KeyOf(*get(const_cast<void*>(buf)));}
+		static constexpr Ops ops = {&invoke, &move, &destroy, &type, &callsite};
+	};
+
+	template <class Fn>
+	struct HeapOps
+	{
+		static Fn*& get(void* buf) {return *reinterpret_cast<Fn**>(buf);}
+		static void invoke(void* buf) {(*get(buf))();}
+		// ポインタを付け替えるだけ
+		static void move(void* dst, void* src) {*reinterpret_cast<Fn**>(dst) = get(src);}
+		static void destroy(void* buf) {delete get(buf);}
+		static const std::type_info& type(const void* buf) {return TypeOf(*get(const_cast<void*>(buf)));}
+		static std::string callsite(const void* buf) {return KeyOf(*get(const_cast<void*>(buf)));}
+		static constexpr Ops ops = {&invoke, &move, &destroy, &type, &callsite};
+	};
+
+	void moveFrom(UniqueFunction& other) noexcept
+	{
+		if(other.m_ops)
+		{
+			other.m_ops->move(m_buf, other.m_buf);
+			m_ops = other.m_ops;
+			other.m_ops = nullptr;
+		}
+	}
+
+	void clear() noexcept
+	{
+		if(m_ops)
+		{
+			m_ops->destroy(m_buf);
+			m_ops = nullptr;
+		}
+	}
+
+private:
+	alignas(std::max_align_t) unsigned char m_buf[INLINE_SIZE];
+	const Ops* m_ops = nullptr;
+
+	static inline std::atomic<uint64_t> s_heapAllocCount{0};
+};
+
+}
+
+#endif